@@ -33,8 +33,11 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <fcntl.h>
@@ -43,7 +46,20 @@
 #include <errno.h>
 #include <assert.h>
 #include <sysexits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/cpuset.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/gpio.h>
 
 /******************************************************************************
@@ -60,8 +76,12 @@
  * P3        		Backlight control circuit
  * P4-P7      		Data, DB4-DB7
  *
- * FIXME: this driver never reads from the device and never checks busy flag.
- * Instead it uses fixed delays to wait for instruction completions.
+ * With the 8-bit data interface the data lines are P4-P11, DB0-DB7.
+ *
+ * By default this driver never reads from the device and never checks busy
+ * flag.  Instead it uses fixed delays to wait for instruction completions.
+ * Optionally, the busy flag can be polled via the R/W line, so that each
+ * instruction is waited for only as long as the controller needs.
  */
 #define debug(lev, fmt, args...)	if (debuglevel >= lev) fprintf(stderr, fmt "\n" , ## args);
 
@@ -69,6 +89,7 @@ static void	usage(void);
 static char	*progname;
 
 #define	DEFAULT_DEVICE	"/dev/gpioc0"
+#define	MMIO_DEVICE	"/dev/mem"
 
 enum command {
 	CMD_RESET,
@@ -79,8 +100,33 @@ enum command {
 	CMD_HOME,
 	CMD_TAB,
 	CMD_FLASH,
+	CMD_EOL,
+	CMD_COUNT,
+};
+
+static const char *const cmd_names[CMD_COUNT] = {
+	[CMD_RESET] = "reset",
+	[CMD_BKSP] = "bksp",
+	[CMD_CLR] = "clr",
+	[CMD_NL] = "nl",
+	[CMD_CR] = "cr",
+	[CMD_HOME] = "home",
+	[CMD_TAB] = "tab",
+	[CMD_FLASH] = "flash",
+	[CMD_EOL] = "eol",
+};
+
+enum esc_state {
+	ESC_NONE,
+	ESC_START,	/* got <ESC> */
+	ESC_GLYPH,	/* collecting glyph bitmap */
+	ESC_BAR,	/* waiting for bar segment width */
+	ESC_CSI,	/* got <ESC>[, collecting parameters */
 };
 
+/* Parameters of <ESC>[ sequences that are looked at, the rest is ignored. */
+#define	HD_CSI_ARGS		2
+
 enum reg_type {
 	HD_COMMAND,
 	HD_DATA
@@ -102,63 +148,490 @@ enum hd_pin_id {
 	HD_PIN_COUNT,
 };
 
-static struct hd44780_state {
+#define	HD_PIN_MASK(id)		(1u << (id))
+#define	HD_DATA_PINS(state)	\
+	((HD_PIN_MASK((state)->hd_ifwidth) - 1) << HD_PIN_DAT0)
+
+/* GPIOACCESS32 operates on banks of 32 pins starting at a multiple of 32. */
+#define	HD_BANK_SIZE		32
+
+/* CGRAM holds 8 user defined glyphs of 8 rows each. */
+#define	HD_GLYPHS		8
+#define	HD_GLYPH_ROWS		8
+
+/* The largest supported display is 4x20 or 2x40. */
+#define	HD_MAX_CELLS		80
+
+/* Shadow value of a cell with unknown contents, never written. */
+#define	HD_CELL_UNKNOWN		0xff
+
+/* Displays driven by one process. */
+#define	HD_MAX_DISPLAYS		8
+
+#define	HD_CMD_CLEAR			0x01
+
+#define	HD_CMD_HOME			0x02
+
+#define	HD_CMD_ENTRYMODE		0x04
+#define		HD_ENTRY_INCR		0x02
+#define		HD_DISP_SHIFT		0x01
+
+#define	HD_CMD_DISPCTRL			0x08
+#define		HD_DISP_ON		0x04
+#define		HD_CURSOR_ON		0x02
+#define		HD_BLINK_ON		0x01
+
+#define	HD_CMD_MOVE			0x10
+#define		HD_MOVE_DISP		0x08
+#define		HD_MOVE_CURSOR		0x00
+#define		HD_MOVE_RIGHT		0x04
+#define		HD_MOVE_LEFT		0x00
+
+#define	HD_CMD_SETMODE			0x20
+#define		HD_MODE_8BIT_IF		0x10
+#define		HD_MODE_2LINES		0x08
+#define		HD_MODE_LARGE_FONT	0x04
+
+#define	HD_CMD_SET_CGADDR		0x40
+
+#define	HD_CMD_SET_ADDR			0x80
+
+#define	HD_LINE_DRAM_SIZE		40
+#define	HD_LINE1_DRAM_OFFSET		0x40
+
+/* Reading the command register returns busy flag and address counter. */
+#define	HD_STATUS_BUSY			0x80
+#define	HD_STATUS_ADDR_MASK		0x7f
+
+/*
+ * Timing of the bus and of the instruction execution, in nanoseconds.
+ */
+#define	USEC(x)		((x) * 1000)
+
+struct hd44780_timing {
+	const char	*name;
+	uint32_t	t_power;	/* power-on wait */
+	uint32_t	t_init;		/* first function set during reset */
+	uint32_t	t_init_next;	/* next function sets during reset */
+	uint32_t	t_setup;	/* RS/RW/data setup before E rises */
+	uint32_t	t_pulse;	/* E pulse width */
+	uint32_t	t_hold;		/* hold after E falls */
+	uint32_t	t_exec;		/* data write, cursor move */
+	uint32_t	t_cmd;		/* other instructions */
+	uint32_t	t_clear;	/* clear display, return home */
+};
+
+static const struct hd44780_timing hd44780_timings[] = {
+	/* Generous delays that work with slow clones, the default. */
+	{
+		.name = "conservative",
+		.t_power = USEC(20000),
+		.t_init = USEC(10000),
+		.t_init_next = USEC(1000),
+		.t_setup = USEC(20),
+		.t_pulse = USEC(40),
+		.t_hold = USEC(20),
+		.t_exec = USEC(40),
+		.t_cmd = USEC(1000),
+		.t_clear = USEC(2000),
+	},
+	/* Datasheet values for 270 kHz oscillator. */
+	{
+		.name = "nominal",
+		.t_power = USEC(15000),
+		.t_init = USEC(4100),
+		.t_init_next = USEC(100),
+		.t_setup = 140,
+		.t_pulse = 450,
+		.t_hold = 550,
+		.t_exec = USEC(41),
+		.t_cmd = USEC(41),
+		.t_clear = USEC(1530),
+	},
+	/* Compatibles clocked about twice as fast as the original. */
+	{
+		.name = "fast",
+		.t_power = USEC(15000),
+		.t_init = USEC(4100),
+		.t_init_next = USEC(100),
+		.t_setup = 140,
+		.t_pulse = 450,
+		.t_hold = 550,
+		.t_exec = USEC(20),
+		.t_cmd = USEC(20),
+		.t_clear = USEC(800),
+	},
+};
+
+struct hd44780_state;
+
+/*
+ * Access to the GPIO pins.  The ioctl method takes the gpioc(4) requests
+ * and their arguments, so the driver works the same with the real device,
+ * with the registers of the GPIO controller mapped into memory and with
+ * the simulated one.
+ */
+struct hd44780_backend {
+	const char	*name;
+	const char	*bk_default_dev;	/* used without -f */
+	int	(*bk_open)(struct hd44780_state *state, const char *devname);
+	void	(*bk_close)(struct hd44780_state *state);
+	int	(*bk_ioctl)(struct hd44780_state *state, unsigned long cmd,
+		    void *arg);
+};
+
+static const struct hd44780_backend gpioc_backend;
+static const struct hd44780_backend bcm2835_backend;
+static const struct hd44780_backend sunxi_backend;
+static const struct hd44780_backend sim_backend;
+
+static const struct hd44780_backend *const backends[] = {
+	&gpioc_backend,
+	&bcm2835_backend,
+	&sunxi_backend,
+	&sim_backend,
+};
+
+/*
+ * Distribution of times in nanoseconds, in buckets of 1/16th of a power of
+ * two, so that recording a value is a few instructions and the error of
+ * a percentile is at most 6%.  Longer times go to the last bucket.
+ */
+#define	HIST_SUB_BITS		4
+#define	HIST_SUB		(1 << HIST_SUB_BITS)
+#define	HIST_MAX_BITS		40
+#define	HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hd44780_hist {
+	uint64_t	h_count;
+	uint64_t	h_sum;
+	uint64_t	h_max;
+	uint64_t	h_buckets[HIST_BUCKETS];
+};
+
+/* Counters for profiling. */
+struct hd44780_stats {
+	uint64_t	st_ioctls;	/* GPIO ioctls issued */
+	uint64_t	st_strobes;	/* E pulses */
+	uint64_t	st_reads;	/* reads from the controller */
+	uint64_t	st_bytes[2];	/* bytes written, by enum reg_type */
+	uint64_t	st_delay_ns;	/* time spent in delays */
+	uint64_t	st_glyph_loads;	/* glyphs uploaded to CGRAM */
+	uint64_t	st_skipped;	/* superseded instructions not executed */
+	uint64_t	st_cmds[CMD_COUNT];	/* commands executed */
+	uint64_t	st_cmd_ns[CMD_COUNT];	/* time spent in commands */
+	struct hd44780_hist st_latency;	/* from input to the display */
+	struct hd44780_hist st_frame;	/* by frame flush */
+	struct hd44780_hist st_output;	/* by byte written */
+};
+
+/*
+ * Displays on the same GPIO controller may share the data lines and differ
+ * only in the E pin.  Transfers to them are serialized with the bus lock,
+ * while waiting for the instructions to complete is done in parallel.
+ */
+struct hd44780_bus {
+	const struct hd44780_backend *b_backend;
+	const char	*b_devname;
+	pthread_mutex_t	b_lock;
+	struct hd44780_state *b_owner;	/* display that used the bus last */
+};
+
+struct hd44780_state {
+	const struct hd44780_backend *hd_backend;
+	void	*hd_backend_priv;
+	const char *hd_devname;
+	struct hd44780_bus *hd_bus;
+	int	hd_num;		/* in displays[] */
+	bool	hd_open;
 	int	hd_fd;
 	int	hd_ifwidth;
 	int	hd_lines;
 	int	hd_cols;
+	int	hd_width;	/* cells per line, the whole DDRAM line in ticker mode */
 	int	hd_blink;
 	int 	hd_cursor;
 	int	hd_font;
 	int	hd_bl_on;
 	int	hd_col;
 	int	hd_row;
+	enum esc_state hd_esc;	/* escape sequence in progress */
+	char	hd_esc_buf[2 * HD_GLYPH_ROWS];
+	int	hd_esc_len;
+	int	hd_esc_args[HD_CSI_ARGS];
+	bool	hd_esc_priv;	/* CSI with private or intermediate bytes */
 	int	pins[HD_PIN_COUNT];
-} hd44780_state;
+	int	hd_epins[HD_MAX_DISPLAYS];	/* E pins of panels given together */
+	int	hd_nepins;
+	uint32_t hd_pin_shared;	/* pins shared with other displays */
+	struct hd44780_glyph {
+		uint8_t		g_bitmap[HD_GLYPH_ROWS];
+		bool		g_loaded;
+		uint64_t	g_used;		/* for LRU replacement */
+	} hd_glyphs[HD_GLYPHS];
+	uint64_t hd_glyph_clock;
+	const struct hd44780_timing *hd_timing;
+	bool	hd_frame_mode;	/* buffer output and flush only changes */
+	bool	hd_coalesce;	/* skip frames superseded by a queued clear */
+	uint64_t hd_refresh;	/* minimum flush interval, ns, 0 if none */
+	uint64_t hd_next_refresh;
+	uint64_t hd_arrival;	/* of input not followed by a flush, or 0 */
+	uint64_t hd_flush_arrival;	/* of the next refresh, or 0 */
+	int	hd_flash;	/* phases of a flash left */
+	uint64_t hd_next_flash;
+	int	hd_rtprio;	/* SCHED_FIFO priority of output, 0 if none */
+	int	hd_cpu;		/* CPU the output is pinned to, -1 if none */
+	uint64_t hd_ticker;	/* ticker scroll interval, ns */
+	uint64_t hd_next_tick;
+	uint8_t	hd_shadow[HD_MAX_CELLS];	/* what the display shows */
+	uint8_t	hd_frame[HD_MAX_CELLS];		/* what it should show */
+	bool	hd_busy_poll;	/* poll busy flag instead of fixed delays */
+	bool	hd_fast_start;	/* pins and controller set up by earlier run */
+	bool	hd_if_ready;	/* interface found set up, skip function sets */
+	int	hd_ac;		/* address counter, -1 if not known */
+	uint32_t hd_pin_known;	/* pins with known output values */
+	uint32_t hd_pin_values;	/* last values written to the pins */
+	uint32_t hd_data_dir;	/* GPIO_PIN_INPUT or _OUTPUT, 0 if not known */
+	bool	hd_bulk;	/* all pins can be written with GPIOACCESS32 */
+	int	hd_bank;	/* first pin of the bank for GPIOACCESS32 */
+	bool	hd_lut_ready;	/* hd_lut is set up for the bulk access */
+	uint32_t hd_lut_clear;	/* bank word of RS, R/W and data pins */
+	uint32_t hd_lut[2][256];	/* bank words by enum reg_type and word */
+	struct hd44780_stats hd_stats;
+	const char *hd_input;	/* input file, standard input if NULL */
+	const char *hd_sockpath;	/* daemon socket */
+	int	hd_sfd;		/* listening socket, -1 if none */
+	int	hd_reply_fd;	/* where <ESC>S is answered */
+	char	**hd_args;	/* message strings */
+	int	hd_nargs;
+	pthread_t hd_thread;
+	struct hd44780_queue *hd_queue;	/* to the output thread, if any */
+	pthread_t hd_output_thread;
+	atomic_bool hd_done;	/* worker has finished */
+};
+
+/*
+ * Instructions from the input parser to the output thread of a display.
+ */
+enum op_type {
+	OP_TEXT,	/* printable characters */
+	OP_COMMAND,
+	OP_GLYPH,
+	OP_MOVE,	/* cursor to op_row, op_col */
+	OP_BACKLIGHT,
+	OP_FLUSH,	/* update the display in frame mode */
+	OP_SCROLL,	/* ticker step */
+	OP_STATS,	/* print statistics to op_fd */
+	OP_SYNC,	/* tell the parser that all before is done */
+	OP_STOP,	/* end of input */
+};
+
+#define	HD_OP_TEXT_MAX		30
+
+struct hd44780_op {
+	uint8_t	op_type;	/* enum op_type */
+	uint8_t	op_len;		/* of op_text */
+	union {
+		char		op_text[HD_OP_TEXT_MAX];
+		struct {
+			enum command	op_cmd;
+			int		op_count;	/* of BKSP and TAB */
+		};
+		uint8_t		op_bitmap[HD_GLYPH_ROWS];
+		struct {
+			uint8_t		op_row;
+			uint8_t		op_col;
+		};
+		bool		op_on;		/* backlight */
+		int		op_fd;
+		uint64_t	op_arrival;	/* of the input flushed */
+	};
+};
+
+/*
+ * Ring of instructions with a single producer and a single consumer.  The
+ * semaphores count the entries, so neither side takes a lock and each only
+ * sleeps when the ring is empty or full.
+ */
+#define	HD_QUEUE_SIZE		1024
+
+struct hd44780_queue {
+	struct hd44780_op q_ops[HD_QUEUE_SIZE];
+	unsigned int	q_head;		/* next to push, parser only */
+	unsigned int	q_tail;		/* next to execute, output only */
+	atomic_uint	q_clear;	/* latest clear pushed, latest-wins mode */
+	sem_t		q_items;	/* pushed, not executed yet */
+	sem_t		q_space;	/* free entries */
+	sem_t		q_synced;	/* OP_SYNC reached */
+};
+
+static struct hd44780_state *displays[HD_MAX_DISPLAYS];
+static int	ndisplays;
+static struct hd44780_bus buses[HD_MAX_DISPLAYS];
+static int	nbuses;
 
 /* Driver functions */
-static void	hd44780_prepare(char *devname, struct hd44780_state * state);
+static void	hd44780_prepare(struct hd44780_state *state);
+static void	hd44780_start(struct hd44780_state *state);
+static bool	hd44780_check_init(struct hd44780_state *state);
+static void	hd44780_config_data_pins(struct hd44780_state *state,
+		    uint32_t flags);
 static void	hd44780_finish(void);
 static void	hd44780_command(struct hd44780_state *state, enum command cmd);
+static void	hd44780_command_n(struct hd44780_state *state,
+		    enum command cmd, int n);
+static void	hd44780_do_command(struct hd44780_state *state,
+		    enum command cmd, int n);
+static void	hd44780_blank(struct hd44780_state *state, int start, int end);
+static void	hd44780_display_ctrl(struct hd44780_state *state, bool on);
+static void	hd44780_flash_step(struct hd44780_state *state);
+static void	hd44780_flash_end(struct hd44780_state *state);
 static void	hd44780_putc(struct hd44780_state *state, int c);
+static void	hd44780_put_glyph(struct hd44780_state *state,
+		    const uint8_t *bitmap);
+static void	hd44780_puts(struct hd44780_state *state, const char *s,
+		    size_t len);
+static void	hd44780_move(struct hd44780_state *state, int row, int col);
+static void	hd44780_backlight(struct hd44780_state *state, bool on);
+static void	hd44780_flush(struct hd44780_state *state);
+static void	hd44780_scroll(struct hd44780_state *state);
+static void	hd44780_track_addr(struct hd44780_state *state,
+		    enum reg_type type, uint8_t data);
+static void	hd44780_print_stats(struct hd44780_state *state, int fd);
+static void	hd44780_latency(struct hd44780_state *state, uint64_t arrival);
+static void	hist_record(struct hd44780_hist *h, uint64_t v);
+static uint64_t	hist_percentile(const struct hd44780_hist *h, double p);
+static void	trace_event(struct hd44780_state *state, uint64_t t,
+		    const char *fmt, ...) __printflike(3, 4);
+static void	trace_ioctl(struct hd44780_state *state, uint64_t t,
+		    unsigned long cmd, const void *arg);
 
 static void	do_char(struct hd44780_state *state, char ch);
+static void	do_csi(struct hd44780_state *state, char ch);
+static void	do_chars(struct hd44780_state *state, const char *buf,
+		    size_t len);
+static void	do_input(struct hd44780_state *state, int fd);
+static void	do_binary(struct hd44780_state *state, int fd);
+static void	wait_input(struct hd44780_state *state, int fd);
+static bool	input_pending(int fd);
+static void	serve_listen(struct hd44780_state *state);
+static void	serve(struct hd44780_state *state);
+static void	sig_quit(int sig);
+static void	sig_wake(int sig);
+
+static struct hd44780_state *display_new(const struct hd44780_state *prev);
+static void	display_expand(void);
+static const char *display_subst(const char *path, int n);
+static void	display_check(struct hd44780_state *state);
+static void	display_attach_bus(struct hd44780_state *state);
+static void	display_stats(int fd);
+static void	run_displays(void);
+static void	*hd44780_worker(void *arg);
+static void	*hd44780_output_worker(void *arg);
+static void	hd44780_output_wait(struct hd44780_state *state);
+static void	hd44780_realtime(struct hd44780_state *state);
+static bool	hd44780_execute(struct hd44780_state *state,
+		    const struct hd44780_op *op);
+
+static void	queue_op(struct hd44780_state *state, enum op_type type);
+static void	queue_text(struct hd44780_state *state, const char *s,
+		    size_t len);
+static void	queue_command(struct hd44780_state *state, enum command cmd);
+static void	queue_command_n(struct hd44780_state *state, enum command cmd,
+		    int n);
+static void	queue_glyph(struct hd44780_state *state,
+		    const uint8_t *bitmap);
+static void	queue_move(struct hd44780_state *state, int row, int col);
+static void	queue_backlight(struct hd44780_state *state, bool on);
+static void	queue_sync(struct hd44780_state *state);
+static bool	queue_superseded(struct hd44780_queue *q);
+
+static volatile sig_atomic_t	quit;
+static bool	print_stats;
+static bool	lock_memory;
+static FILE	*trace;
+static uint64_t	trace_start;
+static pthread_t	main_thread;
 
 static int	debuglevel = 0;
 
+static void	delay_init(void);
+static void	delay(uint32_t nsec);
+static uint64_t	clock_nsec(void);
+static void	bench(struct hd44780_state *state, int frames);
+static void	calibrate(struct hd44780_state *state, const char *path);
+static const struct hd44780_timing *timing_load(const char *path);
+
 int
 main(int argc, char *argv[])
 {
-	struct hd44780_state *state = &hd44780_state;
+	struct hd44780_state *state;
 	extern char	*optarg;
 	extern int	optind;
-	char		*cp, *endp;
-	char		*devname = DEFAULT_DEVICE;
-	int		ch, i;
+	struct sigaction sa;
+	const char	*calib_path, *trace_path;
+	char		*endp, *p;
+	int		ch, i, bench_frames, nstdin;
+	bool		daemonize;
 
+	bench_frames = 0;
+	calib_path = NULL;
+	trace_path = NULL;
 	if ((progname = strrchr(argv[0], '/'))) {
 		progname++;
 	} else {
 		progname = argv[0];
 	}
 
-	state->hd_lines = 2;
-	state->hd_cols = 20;
-	state->hd_ifwidth = 4;
-	for (i = 0; i < HD_PIN_COUNT; i++)
-		state->pins[i] = -1;
-	state->pins[HD_PIN_RS] = 0;
-	state->pins[HD_PIN_RW] = 1;
-	state->pins[HD_PIN_E] = 2;
-	state->pins[HD_PIN_DAT0] = 4;
-
-	while ((ch = getopt(argc, argv, "BCdD:E:f:Fh:I:L:OR:w:W:")) != -1) {
+	state = display_new(NULL);
+	while ((ch = getopt(argc, argv, "a:bBcCdD:E:f:FG:h:i:I:L:mMnNo:Op:P:r:R:s:St:T:w:W:X:")) != -1) {
 		switch(ch) {
 		case 'd':
 			debuglevel++;
 			break;
 		case 'f':
-			devname = optarg;
+			state->hd_devname = optarg;
+			break;
+		case 'i':
+			state->hd_input = optarg;
+			break;
+		case 'N':
+			state = display_new(state);
+			break;
+		case 'G':
+			for (i = 0; i < (int)nitems(backends); i++) {
+				if (strcmp(optarg, backends[i]->name) == 0)
+					break;
+			}
+			if (i == (int)nitems(backends)) {
+				fprintf(stderr, "unknown GPIO backend %s\n", optarg);
+				usage();
+			}
+			state->hd_backend = backends[i];
+			break;
+		case 't':
+			i = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || i <= 0) {
+				fprintf(stderr, "invalid ticker interval %s\n", optarg);
+				usage();
+			}
+			state->hd_ticker = (uint64_t)i * 1000000;
+			break;
+		case 'r':
+			i = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || i <= 0 || i > 1000) {
+				fprintf(stderr, "invalid refresh rate %s\n", optarg);
+				usage();
+			}
+			state->hd_refresh = 1000000000 / i;
+			state->hd_frame_mode = true;
+			break;
+		case 'X':
+			bench_frames = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || bench_frames <= 0) {
+				fprintf(stderr, "invalid number of frames %s\n", optarg);
+				usage();
+			}
 			break;
 		case 'h':
 			state->hd_lines = strtol(optarg, &endp, 10);
@@ -174,15 +647,48 @@ main(int argc, char *argv[])
 				usage();
 			}
 			break;
+		case 'b':
+			state->hd_busy_poll = true;
+			break;
 		case 'B':
 			state->hd_blink = 1;
 			break;
+		case 'c':
+			state->hd_coalesce = true;
+			break;
 		case 'C':
 			state->hd_cursor = 1;
 			break;
 		case 'F':
 			state->hd_font = 1;
 			break;
+		case 'M':
+			state->hd_frame_mode = true;
+			break;
+		case 'n':
+			state->hd_fast_start = true;
+			break;
+		case 'p':
+			i = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || i == 0 ||
+			    i < sched_get_priority_min(SCHED_FIFO) ||
+			    i > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "invalid priority %s\n", optarg);
+				usage();
+			}
+			state->hd_rtprio = i;
+			break;
+		case 'a':
+			i = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || i < 0 || i >= CPU_SETSIZE) {
+				fprintf(stderr, "invalid CPU %s\n", optarg);
+				usage();
+			}
+			state->hd_cpu = i;
+			break;
+		case 'm':
+			lock_memory = true;
+			break;
 		case 'O':
 			state->hd_bl_on = 1;
 			break;
@@ -208,8 +714,20 @@ main(int argc, char *argv[])
 			}
 			break;
 		case 'E':
-			state->pins[HD_PIN_E] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
+			/* A list makes a panel per E pin on a shared bus. */
+			state->hd_nepins = 0;
+			p = optarg;
+			do {
+				if (state->hd_nepins == HD_MAX_DISPLAYS)
+					errx(EX_USAGE, "at most %d displays are "
+					    "supported", HD_MAX_DISPLAYS);
+				state->hd_epins[state->hd_nepins++] =
+				    strtol(p, &endp, 10);
+				if (endp == p)
+					break;
+				p = endp + 1;
+			} while (*endp == ',');
+			if (endp == p || *endp != '\0') {
 				fprintf(stderr, "invalid pin specification %s\n", optarg);
 				usage();
 			}
@@ -221,6 +739,31 @@ main(int argc, char *argv[])
 				usage();
 			}
 			break;
+		case 's':
+			state->hd_sockpath = optarg;
+			break;
+		case 'S':
+			print_stats = true;
+			break;
+		case 'o':
+			trace_path = optarg;
+			break;
+		case 'P':
+			calib_path = optarg;
+			break;
+		case 'T':
+			state->hd_timing = NULL;
+			for (i = 0; i < (int)nitems(hd44780_timings); i++) {
+				if (strcmp(optarg, hd44780_timings[i].name) == 0)
+					state->hd_timing = &hd44780_timings[i];
+			}
+			if (state->hd_timing == NULL)
+				state->hd_timing = timing_load(optarg);
+			if (state->hd_timing == NULL) {
+				fprintf(stderr, "unknown timing profile %s\n", optarg);
+				usage();
+			}
+			break;
 		case 'D':
 			state->pins[HD_PIN_DAT0] = strtol(optarg, &endp, 10);
 			if (*endp != '\0') {
@@ -235,69 +778,376 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (state->hd_ifwidth != 4) {
+	display_expand();
+	for (i = 0; i < ndisplays; i++)
+		display_check(displays[i]);
+
+	/* Message strings are for the first display. */
+	state = displays[0];
+	state->hd_args = argv;
+	state->hd_nargs = argc;
+	if ((state->hd_input != NULL || state->hd_sockpath != NULL ||
+	    bench_frames != 0 || calib_path != NULL) && argc > 0) {
+		fprintf(stderr, "Message strings can not be used with -i, -s, -P or -X\n");
+		usage();
+	}
+	if (calib_path != NULL && !state->hd_busy_poll) {
+		fprintf(stderr, "Calibration requires busy flag polling\n");
+		usage();
+	}
+	nstdin = 0;
+	for (i = 0; i < ndisplays; i++) {
+		if (displays[i]->hd_input == NULL &&
+		    displays[i]->hd_sockpath == NULL &&
+		    displays[i]->hd_nargs == 0)
+			nstdin++;
+	}
+	if (nstdin > 1 && bench_frames == 0 && calib_path == NULL) {
+		fprintf(stderr, "Only one display can read standard input\n");
+		usage();
+	}
+	for (i = 0; i < ndisplays; i++)
+		display_attach_bus(displays[i]);
+
+	/*
+	 * Let a blocked accept, poll or read return on these signals, so
+	 * that the display is left in a consistent state.  Once the workers
+	 * run, the signals are taken by the main thread, which passes them
+	 * on with SIGUSR1.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sig_quit;
+	(void)sigaction(SIGINT, &sa, NULL);
+	(void)sigaction(SIGTERM, &sa, NULL);
+	(void)sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = sig_wake;
+	(void)sigaction(SIGUSR1, &sa, NULL);
+	/* Ignored signals are discarded, even while blocked. */
+	(void)sigaction(SIGINFO, &sa, NULL);
+
+	if (trace_path != NULL) {
+		if ((trace = fopen(trace_path, "w")) == NULL)
+			err(EX_CANTCREAT, "can't open '%s'", trace_path);
+		trace_start = clock_nsec();
+	}
+
+	delay_init();
+	atexit(hd44780_finish);
+	for (i = 0; i < ndisplays; i++)
+		hd44780_prepare(displays[i]);
+
+	if (bench_frames != 0) {
+		hd44780_realtime(state);
+		hd44780_start(state);
+		bench(state, bench_frames);
+		hd44780_flush(state);
+		exit(EX_OK);
+	}
+	if (calib_path != NULL) {
+		hd44780_realtime(state);
+		hd44780_start(state);
+		calibrate(state, calib_path);
+		exit(EX_OK);
+	}
+
+	daemonize = false;
+	for (i = 0; i < ndisplays; i++) {
+		if (displays[i]->hd_sockpath != NULL) {
+			serve_listen(displays[i]);
+			daemonize = true;
+		}
+	}
+	/* Stay in the cwd: -s and -i paths may be relative. */
+	if (daemonize && debuglevel == 0 && daemon(1, 0) == -1)
+		err(EX_OSERR, "daemon");
+
+	/*
+	 * Keep the output from waiting for page faults, stacks included.
+	 * Locks are not inherited by the child of daemon().
+	 */
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("mlockall");
+
+	run_displays();
+	exit(EX_OK);
+}
+
+/*
+ * Allocate the next display.  It starts with the settings of the previous
+ * one, so that only what differs needs to be given, but not with its input.
+ */
+static struct hd44780_state *
+display_new(const struct hd44780_state *prev)
+{
+	struct hd44780_state *state;
+	int i;
+
+	if (ndisplays == HD_MAX_DISPLAYS)
+		errx(EX_USAGE, "at most %d displays are supported",
+		    HD_MAX_DISPLAYS);
+	if ((state = calloc(1, sizeof(*state))) == NULL)
+		err(EX_OSERR, "calloc");
+
+	if (prev != NULL) {
+		memcpy(state, prev, sizeof(*state));
+		state->hd_input = NULL;
+		state->hd_sockpath = NULL;
+	} else {
+		state->hd_lines = 2;
+		state->hd_cols = 20;
+		state->hd_cpu = -1;
+		state->hd_ifwidth = 4;
+		for (i = 0; i < HD_PIN_COUNT; i++)
+			state->pins[i] = -1;
+		state->pins[HD_PIN_RS] = 0;
+		state->pins[HD_PIN_RW] = 1;
+		state->hd_epins[0] = 2;
+		state->hd_nepins = 1;
+		state->pins[HD_PIN_DAT0] = 4;
+		state->hd_timing = &hd44780_timings[0];
+		state->hd_backend = &gpioc_backend;
+	}
+	state->hd_sfd = -1;
+	state->hd_reply_fd = STDERR_FILENO;
+	state->hd_num = ndisplays;
+	displays[ndisplays++] = state;
+	return (state);
+}
+
+/*
+ * Panels on a shared bus differ only in the E pin.  Make a display of each
+ * E pin given in a list, with the panel number substituted for %d in the
+ * input paths.
+ */
+static void
+display_expand(void)
+{
+	struct hd44780_state *list[HD_MAX_DISPLAYS], *prev, *state;
+	const char *input, *sockpath;
+	int i, k, n;
+
+	n = 0;
+	for (i = 0; i < ndisplays; i++) {
+		prev = displays[i];
+		input = prev->hd_input;
+		sockpath = prev->hd_sockpath;
+		for (k = 0; k < prev->hd_nepins; k++) {
+			if (n == HD_MAX_DISPLAYS)
+				errx(EX_USAGE, "at most %d displays are "
+				    "supported", HD_MAX_DISPLAYS);
+			if (k == 0) {
+				state = prev;
+			} else {
+				if ((state = malloc(sizeof(*state))) == NULL)
+					err(EX_OSERR, "malloc");
+				memcpy(state, prev, sizeof(*state));
+			}
+			state->pins[HD_PIN_E] = prev->hd_epins[k];
+			if (prev->hd_nepins > 1) {
+				state->hd_input = display_subst(input, k);
+				state->hd_sockpath = display_subst(sockpath, k);
+			}
+			state->hd_num = n;
+			list[n++] = state;
+		}
+	}
+	memcpy(displays, list, n * sizeof(list[0]));
+	ndisplays = n;
+}
+
+static const char *
+display_subst(const char *path, int n)
+{
+	const char *p;
+	char *s;
+
+	if (path == NULL)
+		return (NULL);
+	if ((p = strstr(path, "%d")) == NULL)
+		errx(EX_USAGE, "'%s' needs %%d for the panel number", path);
+	if (asprintf(&s, "%.*s%d%s", (int)(p - path), path, n, p + 2) == -1)
+		err(EX_OSERR, "asprintf");
+	return (s);
+}
+
+static void
+display_check(struct hd44780_state *state)
+{
+	int i, j;
+
+	if (state->hd_devname == NULL)
+		state->hd_devname = state->hd_backend->bk_default_dev;
+
+	if (state->hd_ifwidth != 4 && state->hd_ifwidth != 8) {
 		fprintf(stderr, "Unsupported data interface width %d\n", state->hd_ifwidth);
 		usage();
 	}
 	for (i = 1; i < state->hd_ifwidth; i++) {
 		state->pins[HD_PIN_DAT0 + i] = state->pins[HD_PIN_DAT0] + i;
 	}
+	for (; i < 8; i++)
+		state->pins[HD_PIN_DAT0 + i] = -1;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		for (j = i + 1; j < HD_PIN_COUNT; j++) {
+			if (state->pins[i] != -1 &&
+			    state->pins[i] == state->pins[j]) {
+				fprintf(stderr, "Pin %d is used twice\n",
+				    state->pins[i]);
+				usage();
+			}
+		}
+	}
 
 	if (state->hd_lines != 1 && state->hd_lines != 2 && state->hd_lines != 4) {
 		fprintf(stderr, "Unsupported number of lines %d\n", state->hd_lines);
 		usage();
 	}
-	if (state->hd_cols <= 0 || state->hd_lines * state->hd_cols > 80) {
+	if (state->hd_cols <= 0 ||
+	    state->hd_lines * state->hd_cols > HD_MAX_CELLS) {
 		fprintf(stderr, "Unsupported number of columns %d\n", state->hd_cols);
 		usage();
 	}
 
+	state->hd_width = state->hd_cols;
+	if (state->hd_ticker != 0) {
+		if (state->hd_lines > 2 || state->hd_frame_mode) {
+			fprintf(stderr, "Ticker mode needs a 1 or 2-line display "
+			    "and can not be used with -M or -r\n");
+			usage();
+		}
+		/* In the 1-line mode the line is all of DDRAM. */
+		state->hd_width = (state->hd_lines == 1) ?
+		    2 * HD_LINE_DRAM_SIZE : HD_LINE_DRAM_SIZE;
+	}
+
+	if (state->hd_busy_poll && state->pins[HD_PIN_RW] == -1) {
+		fprintf(stderr, "R/W pin is required for busy flag polling\n");
+		usage();
+	}
 	if (state->hd_bl_on && state->pins[HD_PIN_BL] == -1) {
 		fprintf(stderr, "Backlight pin is not specified\n");
 		usage();
 	}
+}
 
-	hd44780_prepare(devname, state);
-	atexit(hd44780_finish);
+/*
+ * Displays on the same GPIO controller share a bus.  Their pins may overlap,
+ * except for E which selects the display.  Simulated displays are separate
+ * devices each.  Only the values of the shared pins can be changed by the
+ * other displays.
+ */
+static void
+display_attach_bus(struct hd44780_state *state)
+{
+	struct hd44780_state *other;
+	struct hd44780_bus *bus;
+	int i, j, k, n;
 
-	if (argc > 0) {
-		debug(2, "reading input from %d argument%s", argc, (argc > 1) ? "s" : "");
-		for (i = 0; i < argc; i++)
-			for (cp = argv[i]; *cp; cp++)
-				do_char(state, *cp);
-	} else {
-		debug(2, "reading input from stdin");
-		setvbuf(stdin, NULL, _IONBF, 0);
-		while ((ch = fgetc(stdin)) != EOF)
-			do_char(state, (char)ch);
+	for (n = 0; displays[n] != state; n++)
+		continue;
+	bus = NULL;
+	for (i = 0; i < nbuses && state->hd_backend != &sim_backend; i++) {
+		if (buses[i].b_backend == state->hd_backend &&
+		    strcmp(buses[i].b_devname, state->hd_devname) == 0) {
+			bus = &buses[i];
+			break;
+		}
 	}
-	exit(EX_OK);
+	if (bus == NULL) {
+		bus = &buses[nbuses++];
+		bus->b_backend = state->hd_backend;
+		bus->b_devname = state->hd_devname;
+		pthread_mutex_init(&bus->b_lock, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		other = displays[i];
+		if (other->hd_bus != bus)
+			continue;
+		for (j = 0; j < HD_PIN_COUNT; j++) {
+			if (other->pins[j] == state->pins[HD_PIN_E] ||
+			    state->pins[j] == other->pins[HD_PIN_E])
+				errx(EX_USAGE, "E pin of display %d is shared "
+				    "with display %d", n, i);
+			for (k = 0; k < HD_PIN_COUNT; k++) {
+				if (state->pins[j] != -1 &&
+				    state->pins[j] == other->pins[k]) {
+					state->hd_pin_shared |= HD_PIN_MASK(j);
+					other->hd_pin_shared |= HD_PIN_MASK(k);
+				}
+			}
+		}
+	}
+	state->hd_bus = bus;
 }
 
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: %s [-f device] [-d] [-B] [-C] [-F] [-O] "
-	    "[-h <n>] [-w <n>] [-R <n>]\n"
-	    "\t[-W <n>] [-E <n>] [-L <n>] [-D <n>] [-I <n>] [args...]\n",
+	fprintf(stderr, "usage: %s [-f device] [-d] [-b] [-B] [-c] [-C] [-F] [-m] [-M] [-n]\n"
+	    "\t[-O] [-r <hz>] [-S] [-h <n>] [-w <n>] [-R <n>] [-W <n>] [-E <n>[,<n>...]]\n"
+	    "\t[-L <n>] [-D <n>] [-I <n>] [-G <backend>] [-T <profile>]\n"
+	    "\t[-i <path> | -s <path>] [-t <ms>] [-N display options...]\n"
+	    "\t[-o <path>] [-P <path>] [-p <prio>] [-a <cpu>] [-X <n>]\n"
+	    "\t[args...]\n",
 	    progname);
 	fprintf(stderr, "Supported hardware: Hitachi HD44780 and compatibles\n");
 	fprintf(stderr, "   -d      Increase debugging\n");
-	fprintf(stderr, "   -f      Specify device, default is '%s'\n", DEFAULT_DEVICE);
+	fprintf(stderr, "   -f      Specify device, default is '%s', or the\n"
+			"           physical address of the GPIO registers\n",
+			DEFAULT_DEVICE);
+	fprintf(stderr, "   -G <backend>  GPIO access: gpioc (default), sim,\n"
+			"           a simulated display, or bcm2835 or sunxi,\n"
+			"           the registers of the SoC mapped from %s\n",
+			MMIO_DEVICE);
 	fprintf(stderr, "   -h <n>  n-line display (default 2)\n"
 			"   -w <n>  n-column display (default 20)\n"
+			"   -i <path>  Read input from a file instead of stdin\n"
+			"   -b      Poll busy flag instead of fixed delays\n"
+			"           and skip the reset if the display is set up\n"
 			"   -B      Cursor blink enable\n"
+			"   -c      Latest wins, skip screens that are cleared\n"
+			"           before they are shown\n"
 			"   -C      Cursor enable\n"
 			"   -F      Large font select\n"
 			"   -R <n>  R/S pin number (default 0)\n"
 			"   -W <n>  R/W pin number (default 1)\n"
-			"   -E <n>  E pin number (default 2)\n"
+			"   -E <n>[,<n>...]  E pin number (default 2), a list\n"
+			"           for panels that share the other pins, %%d in\n"
+			"           -i and -s paths is replaced with the panel number\n"
 			"   -L <n>  Backlight pin number (default none)\n"
+			"   -m      Lock the memory of the process\n"
+			"   -M      Frame mode, write only changed characters\n"
+			"   -n      Fast start, assume that the pins and the\n"
+			"           display are set up by an earlier run\n"
+			"   -N      Configure the next display, starting with\n"
+			"           the options of the previous one but -i and -s\n"
+			"   -o <path>  Write a trace of the GPIO requests of\n"
+			"           all displays to a file\n"
 			"   -O      Turn backlight on (default off)\n"
+			"   -p <prio>  Drive the display with SCHED_FIFO\n"
+			"           real-time priority prio\n"
+			"   -a <cpu>  Drive the display on CPU cpu only\n"
+			"   -r <hz> Frame mode, update the display at most hz\n"
+			"           times a second\n"
+			"   -S      Print statistics and timing distributions\n"
+			"           on exit\n"
 			"   -D <n>  First data pin number (default 4)\n"
-			"   -I <n>  Data interface width (only 4 is supported)\n");
-	fprintf(stderr, "  args     Message strings.\n");
+			"   -I <n>  Data interface width, 4 or 8 (default 4)\n"
+			"   -T <profile>  Timing profile: conservative (default),\n"
+			"           nominal or fast, or a file written by -P\n"
+			"   -P <path>  Time the instructions on the display, which\n"
+			"           needs -b, and write a timing profile to path\n"
+			"   -s <path>  Run as a daemon reading input from clients\n"
+			"           of a local socket; stays in foreground with -d,\n"
+			"           clients starting with a NUL byte send binary\n"
+			"           messages instead of text\n"
+			"   -t <ms> Ticker mode, lines can be as long as the\n"
+			"           display memory and the display scrolls every ms\n"
+			"   -X <n>  Run benchmarks of n frames each\n");
+	fprintf(stderr, "  args     Message strings for the first display.\n");
 	fprintf(stderr, "           Some ASCII control characters and escapes sequences are supported:\n");
 	fprintf(stderr, "                  <BS> (\\b)	Backspace\n");
 	fprintf(stderr, "                  <LF> (\\f)	Clear display, home cursor\n");
@@ -307,412 +1157,3369 @@ usage(void)
 	fprintf(stderr, "                  <BEL> (\\a)	Flash screen\n");
 	fprintf(stderr, "                  <ESC>R	Reset display\n");
 	fprintf(stderr, "                  <ESC>H	Home cursor\n");
+	fprintf(stderr, "                  <ESC>S	Print statistics\n");
+	fprintf(stderr, "                  <ESC>g<hex>	Custom glyph, 16 hex digits for 8 rows\n");
+	fprintf(stderr, "                  <ESC>b<n>	Bar graph segment, n of 5 columns lit\n");
+	fprintf(stderr, "                  <ESC>[<r>;<c>H	Move cursor to row r, column c\n");
+	fprintf(stderr, "                  <ESC>[K	Erase to end of line\n");
+	fprintf(stderr, "                  <ESC>[2J	Clear display, home cursor\n");
 	fprintf(stderr, "           If args not supplied, strings are read from standard input\n");
 	exit(EX_USAGE);
 }
 
-static void
-do_char(struct hd44780_state *state, char ch)
+static bool
+input_pending(int fd)
 {
-	static int	esc = 0;
-
-	if (esc) {
-		switch(ch) {
-		case 'R':
-			hd44780_command(state, CMD_RESET);
-			break;
-		case 'H':
-			hd44780_command(state, CMD_HOME);
-			break;
-		}
-		esc = 0;
-		return;
-	}
-
-	if (ch == 27) {
-		esc = 1;
-		return;
-	}
+	struct pollfd pfd;
 
-	switch(ch) {
-	case '\n':
-		hd44780_command(state, CMD_NL);
-		break;
-	case '\r':
-		hd44780_command(state, CMD_CR);
-		break;
-	case '\t':
-		hd44780_command(state, CMD_TAB);
-		break;
-	case '\a':
-		hd44780_command(state, CMD_FLASH);
-		break;
-	case '\b':
-		hd44780_command(state, CMD_BKSP);
-		break;
-	case '\f':
-		hd44780_command(state, CMD_CLR);
-		break;
-	default:
-		if (isascii(ch) && isprint(ch))
-			hd44780_putc(state, ch);
-		break;
-	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) > 0);
 }
 
 static void
-hd44780_set_pin(struct hd44780_state *state, enum hd_pin_id pin, bool on)
+sig_quit(int sig __unused)
 {
-	struct gpio_req req;
-	int err;
 
-	assert(state->pins[pin] != -1);
-	req.gp_pin = state->pins[pin];
-	req.gp_value = on;
-	err = ioctl(state->hd_fd, GPIOSET, &req);
-	if (err != 0)
-		debug(1, "%s: error %d", __func__, errno);
+	quit = 1;
 }
 
+/* Only interrupt a blocking call of a worker. */
 static void
-hd44780_strobe(struct hd44780_state *state)
+sig_wake(int sig __unused)
 {
-	usleep(20);
-	hd44780_set_pin(state, HD_PIN_E, true);
-	usleep(40);
-	hd44780_set_pin(state, HD_PIN_E, false);
-	usleep(20);
 }
 
-/* FIXME: hardcoded to 4-bit data interface. */
-static void
-hd44780_output(struct hd44780_state *state, enum reg_type type, uint8_t data)
-{
-	int i;
-
-	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
-
-	hd44780_set_pin(state, HD_PIN_RW, false);
+/*
+ * Take the input of one display.  Each display has its own thread, so
+ * that the delays of one controller do not hold up the others.  The
+ * input is parsed here and the display is driven by an output thread,
+ * so that reading does not wait for the display.
+ */
+static void *
+hd44780_worker(void *arg)
+{
+	struct hd44780_state *state = arg;
+	struct hd44780_queue *q;
+	int error, fd, i;
 
-	if (type == HD_COMMAND)
-		hd44780_set_pin(state, HD_PIN_RS, false);
-	else
-		hd44780_set_pin(state, HD_PIN_RS, true);
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		err(EX_OSERR, "calloc");
+	sem_init(&q->q_items, 0, 0);
+	sem_init(&q->q_space, 0, HD_QUEUE_SIZE);
+	sem_init(&q->q_synced, 0, 0);
+	state->hd_queue = q;
+	error = pthread_create(&state->hd_output_thread, NULL,
+	    hd44780_output_worker, state);
+	if (error != 0)
+		errc(EX_OSERR, error, "pthread_create");
 
-	/* Set upper nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << (i + 4)) & data) != 0);
+	state->hd_next_tick = clock_nsec() + state->hd_ticker;
+	if (state->hd_sockpath != NULL) {
+		serve(state);
+	} else if (state->hd_nargs > 0) {
+		debug(2, "reading input from %d argument%s", state->hd_nargs,
+		    (state->hd_nargs > 1) ? "s" : "");
+		for (i = 0; i < state->hd_nargs; i++)
+			do_chars(state, state->hd_args[i],
+			    strlen(state->hd_args[i]));
+	} else if (state->hd_input != NULL) {
+		debug(2, "reading input from %s", state->hd_input);
+		if ((fd = open(state->hd_input, O_RDONLY)) != -1) {
+			do_input(state, fd);
+			close(fd);
+		} else if (errno != EINTR) {
+			warn("can't open '%s'", state->hd_input);
+		}
+	} else {
+		debug(2, "reading input from stdin");
+		do_input(state, STDIN_FILENO);
 	}
 
-	hd44780_strobe(state);
-
-	/* Set lower nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << i) & data) != 0);
-	}
+	/* Keep the ticker going after the end of input. */
+	while (state->hd_ticker != 0 && !quit)
+		wait_input(state, -1);
+	queue_op(state, OP_FLUSH);
+	queue_op(state, OP_STOP);
+	pthread_join(state->hd_output_thread, NULL);
 
-	hd44780_strobe(state);
+	atomic_store(&state->hd_done, true);
+	pthread_kill(main_thread, SIGUSR2);
+	return (NULL);
 }
 
-static void
-hd44780_output4(struct hd44780_state *state, enum reg_type type, uint8_t data)
+/*
+ * Drive the display with the instructions from the parser.
+ */
+static void *
+hd44780_output_worker(void *arg)
 {
-	int i;
-
-	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	struct hd44780_state *state = arg;
+	struct hd44780_queue *q = state->hd_queue;
+	bool more;
 
-	hd44780_set_pin(state, HD_PIN_RW, false);
+	hd44780_realtime(state);
+	hd44780_start(state);
+	state->hd_next_refresh = clock_nsec();
+	do {
+		hd44780_output_wait(state);
+		if (state->hd_coalesce && queue_superseded(q)) {
+			state->hd_stats.st_skipped++;
+			more = true;
+		} else {
+			more = hd44780_execute(state,
+			    &q->q_ops[q->q_tail % HD_QUEUE_SIZE]);
+		}
+		q->q_tail++;
+		sem_post(&q->q_space);
+	} while (more);
+	return (NULL);
+}
 
-	if (type == HD_COMMAND)
-		hd44780_set_pin(state, HD_PIN_RS, false);
-	else
-		hd44780_set_pin(state, HD_PIN_RS, true);
+/*
+ * Make the calling thread, which drives the display, run before the other
+ * work of the host, and only on the CPU it is given, so that the delays
+ * end when they should.  Without the privilege to do so the display is
+ * driven as before.
+ */
+static void
+hd44780_realtime(struct hd44780_state *state)
+{
+	struct sched_param param;
+	cpuset_t mask;
+	int error;
 
-	/* Set upper nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << (i + 4)) & data) != 0);
+	if (state->hd_cpu != -1) {
+		CPU_ZERO(&mask);
+		CPU_SET(state->hd_cpu, &mask);
+		if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+		    sizeof(mask), &mask) == -1)
+			warn("can't pin display %d to CPU %d", state->hd_num,
+			    state->hd_cpu);
+	}
+	if (state->hd_rtprio != 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = state->hd_rtprio;
+		error = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+		    &param);
+		if (error != 0)
+			warnc(error, "can't set real-time priority of "
+			    "display %d", state->hd_num);
 	}
-
-	hd44780_strobe(state);
 }
 
+/*
+ * Wait for the next instruction.  With the rate limited refresh the
+ * instructions only change the frame buffer, and it is flushed here when
+ * its time comes, however busy the input is.  The steps of a flash are
+ * timed here as well, so that the output goes on meanwhile.
+ */
 static void
-hd44780_prepare(char *devname, struct hd44780_state *state)
+hd44780_output_wait(struct hd44780_state *state)
 {
-	struct gpio_pin cfg;
-	int error, i;
-
-	if ((state->hd_fd = open(devname, O_RDWR, 0)) == -1)
-		err(EX_OSFILE, "can't open '%s'", devname);
+	struct hd44780_queue *q = state->hd_queue;
+	struct timespec ts;
+	uint64_t deadline, now, nsec;
 
-	/*
-	 * Before anything else set E as input to avoid triggering
-	 * it as a possible side-effect of changing other pins.
-	 */
-	cfg.gp_pin = state->pins[HD_PIN_E];
-	cfg.gp_flags = GPIO_PIN_INPUT;
-	error = ioctl(state->hd_fd, GPIOSETCONFIG, &cfg);
-	if (error != 0)
-		err(1, "configuring pin %d as input failed",
-		    cfg.gp_pin);
+	for (;;) {
+		now = clock_nsec();
+		if (state->hd_refresh != 0 && now >= state->hd_next_refresh) {
+			hd44780_flush(state);
+			hd44780_latency(state, state->hd_flush_arrival);
+			state->hd_flush_arrival = 0;
+			state->hd_next_refresh = now + state->hd_refresh;
+		}
+		if (state->hd_flash > 0 && now >= state->hd_next_flash)
+			hd44780_flash_step(state);
 
-	/* Configure GPIO pins. */
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
+		deadline = UINT64_MAX;
+		if (state->hd_refresh != 0)
+			deadline = state->hd_next_refresh;
+		if (state->hd_flash > 0)
+			deadline = MIN(deadline, state->hd_next_flash);
+		if (deadline == UINT64_MAX) {
+			if (sem_wait(&q->q_items) == 0)
+				return;
 			continue;
-		cfg.gp_pin = state->pins[i];
-		cfg.gp_flags = GPIO_PIN_INPUT;
-		(void)ioctl(state->hd_fd, GPIOSETCONFIG, &cfg);
+		}
+
+		/* sem_timedwait(3) takes the time of CLOCK_REALTIME. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		nsec = ts.tv_nsec + (deadline > now ? deadline - now : 0);
+		ts.tv_sec += nsec / 1000000000;
+		ts.tv_nsec = nsec % 1000000000;
+		if (sem_timedwait(&q->q_items, &ts) == 0)
+			return;
 	}
+}
 
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
-			continue;
-		cfg.gp_pin = state->pins[i];
-		cfg.gp_flags = GPIO_PIN_OUTPUT;
-		error = ioctl(state->hd_fd, GPIOSETCONFIG, &cfg);
+/* Wake up a worker that may be blocked before it checks quit again. */
+#define	WAKE_INTERVAL_NS	100000000
+
+/*
+ * Run the workers and wait for all of them to finish.  The signals are
+ * handled here, the workers only see SIGUSR1 and they tell that they are
+ * done with SIGUSR2.
+ */
+static void
+run_displays(void)
+{
+	struct timespec ts;
+	sigset_t set;
+	int error, i, running, sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINFO);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	main_thread = pthread_self();
+
+	for (i = 0; i < ndisplays; i++) {
+		error = pthread_create(&displays[i]->hd_thread, NULL,
+		    hd44780_worker, displays[i]);
 		if (error != 0)
-			err(1, "configuring pin %d as output failed",
-			    cfg.gp_pin);
+			errc(EX_OSERR, error, "pthread_create");
 	}
 
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
-			continue;
+	ts.tv_sec = 0;
+	ts.tv_nsec = WAKE_INTERVAL_NS;
+	for (;;) {
+		running = 0;
+		for (i = 0; i < ndisplays; i++) {
+			if (atomic_load(&displays[i]->hd_done))
+				continue;
+			running++;
+			if (quit)
+				pthread_kill(displays[i]->hd_thread, SIGUSR1);
+		}
+		if (running == 0)
+			break;
 
-		hd44780_set_pin(state, i, false);
+		if (quit)
+			sig = sigtimedwait(&set, NULL, &ts);
+		else
+			sig = sigwaitinfo(&set, NULL);
+		if (sig == SIGINFO)
+			display_stats(STDERR_FILENO);
+		else if (sig == SIGINT || sig == SIGTERM || sig == SIGHUP)
+			quit = 1;
 	}
 
-	usleep(20000);
-	hd44780_command(state, CMD_RESET);
-
-	if (state->hd_bl_on)
-		hd44780_set_pin(state, HD_PIN_BL, true);
+	for (i = 0; i < ndisplays; i++)
+		pthread_join(displays[i]->hd_thread, NULL);
 }
 
+/*
+ * Create the socket of a display, before detaching from the terminal so
+ * that errors can still be seen.
+ */
 static void
-hd44780_finish(void)
+serve_listen(struct hd44780_state *state)
 {
-	close(hd44780_state.hd_fd);
-}
-
-#define	HD_CMD_CLEAR			0x01
-
-#define	HD_CMD_HOME			0x02
-
-#define	HD_CMD_ENTRYMODE		0x04
-#define		HD_ENTRY_INCR		0x02
-#define		HD_DISP_SHIFT		0x01
+	struct sockaddr_un sun;
+	const char *path = state->hd_sockpath;
 
-#define	HD_CMD_DISPCTRL			0x08
-#define		HD_DISP_ON		0x04
-#define		HD_CURSOR_ON		0x02
-#define		HD_BLINK_ON		0x01
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(EX_USAGE, "socket path '%s' is too long", path);
 
-#define	HD_CMD_MOVE			0x10
-#define		HD_MOVE_DISP		0x08
-#define		HD_MOVE_CURSOR		0x00
-#define		HD_MOVE_RIGHT		0x04
-#define		HD_MOVE_LEFT		0x00
+	if ((state->hd_sfd = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1)
+		err(EX_OSERR, "socket");
+	(void)unlink(path);
+	if (bind(state->hd_sfd, (struct sockaddr *)&sun, SUN_LEN(&sun)) == -1)
+		err(EX_OSERR, "can't bind to '%s'", path);
+	if (listen(state->hd_sfd, 5) == -1)
+		err(EX_OSERR, "listen");
 
-#define	HD_CMD_SETMODE			0x20
-#define		HD_MODE_8BIT_IF		0x10
-#define		HD_MODE_2LINES		0x08
-#define		HD_MODE_LARGE_FONT	0x04
+	signal(SIGPIPE, SIG_IGN);
+}
 
-#define	HD_CMD_SET_CGADDR		0x40
+/*
+ * The binary protocol of the daemon lets a client send whole screen
+ * updates in one write, placed by position instead of with control
+ * characters and escapes.  After the MSG_MAGIC byte the connection carries
+ * messages of a type byte, a length byte and that many bytes of payload:
+ *
+ *	MSG_RUN		row, column, characters written from there on
+ *	MSG_FRAME	characters of the lines one after another, hd_cols
+ *			each; the cells left out are blanked
+ *	MSG_GLYPH	row, column, 8 rows of a custom glyph put there
+ *	MSG_BACKLIGHT	0 for off, anything else for on
+ *	MSG_FLUSH	update the display in frame mode
+ *
+ * Positions start at 0 and are clipped to the display.  The characters go
+ * to the display as they are, those below the space are taken as blanks,
+ * as the codes of the user defined glyphs are managed by the driver.
+ * Messages of other types are skipped.
+ */
+#define	MSG_MAGIC		0x00
 
-#define	HD_CMD_SET_ADDR			0x80
+enum msg_type {
+	MSG_RUN = 1,
+	MSG_FRAME,
+	MSG_GLYPH,
+	MSG_BACKLIGHT,
+	MSG_FLUSH,
+};
 
-#define	HD_LINE_DRAM_SIZE		40
-#define	HD_LINE1_DRAM_OFFSET		0x40
+#define	MSG_HDR_LEN		2
 
-static uint8_t
-hd44780_calc_addr(struct hd44780_state *state)
+/*
+ * Keep the display open and initialized, and take input from clients
+ * connecting to a local socket.  Clients are served one at a time, each
+ * until it closes its end of the connection.  A client that starts with
+ * MSG_MAGIC speaks the binary protocol, any other the text one.
+ */
+static void
+serve(struct hd44780_state *state)
 {
-	uint8_t addr;
+	uint8_t c;
+	int cfd;
 
-	addr = state->hd_col;
-	if (state->hd_row == 1 || state->hd_row == 3)
-		addr += HD_LINE1_DRAM_OFFSET;
-	if (state->hd_row == 2 || state->hd_row == 3)
-		addr += state->hd_cols;
-	return (addr);
+	debug(2, "listening on %s", state->hd_sockpath);
+	while (!quit) {
+		wait_input(state, state->hd_sfd);
+		if ((cfd = accept(state->hd_sfd, NULL, NULL)) == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				warn("accept");
+			continue;
+		}
+		debug(2, "client connected");
+		state->hd_reply_fd = cfd;
+		wait_input(state, cfd);
+		if (recv(cfd, &c, 1, MSG_PEEK) == 1 && c == MSG_MAGIC &&
+		    read(cfd, &c, 1) == 1)
+			do_binary(state, cfd);
+		else
+			do_input(state, cfd);
+		/* Answers to the client may still be queued. */
+		queue_sync(state);
+		state->hd_reply_fd = STDERR_FILENO;
+		close(cfd);
+		debug(2, "client disconnected");
+	}
 }
 
+/*
+ * Read input in blocks and process it until end of file.  In frame mode
+ * the display is updated whenever no more input is immediately available,
+ * so interactive use sees every change as soon as it is typed.
+ */
 static void
-hd44780_command(struct hd44780_state *state, enum command cmd)
+do_input(struct hd44780_state *state, int fd)
 {
-	int i;
-	uint8_t	val;
-
-	switch (cmd) {
-	case CMD_RESET:	/* full manual reset and reconfigure as per datasheet */
-		debug(1, "hd44780: reset to %d-bit interface, %d lines, "
-		    "%s font,%s%s cursor",
-		    state->hd_ifwidth, state->hd_lines,
-		    state->hd_font ? "5x10" : "5x8",
-		    state->hd_cursor ? "" : " no",
-		    state->hd_blink ? " blinking" : "");
+	char buf[BUFSIZ];
+	ssize_t n;
 
-		/*
-		 * This needs to be repeated three times to guarantee a state
-		 * where the desired mode can be configured.
-		 */
-		val = HD_CMD_SETMODE;
-		val |= HD_MODE_8BIT_IF;
-		hd44780_output4(state, HD_COMMAND, val);
-		usleep(10000);
-		hd44780_output4(state, HD_COMMAND, val);
-		usleep(1000);
-		hd44780_output4(state, HD_COMMAND, val);
-		usleep(1000);
-
-		val = HD_CMD_SETMODE;
-		if (state->hd_ifwidth == 8)
-			val |= HD_MODE_8BIT_IF;
-		if (state->hd_lines != 1)
-			val |= HD_MODE_2LINES;
-		if (state->hd_font)
-			val |= HD_MODE_LARGE_FONT;
+	while (!quit) {
+		wait_input(state, fd);
+		n = read(fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			warn("read");
+		if (n <= 0)
+			break;
+		if (state->hd_arrival == 0)
+			state->hd_arrival = clock_nsec();
+		do_chars(state, buf, n);
 
-		/*
-		 * At this point the display is in 8-bit mode, so execute
-		 * a command to enter the 4-bit mode if needed.
-		 */
-		if (state->hd_ifwidth == 4)
-			hd44780_output4(state, HD_COMMAND, val);
+		/* The end of an update, for the latency if not for the frame. */
+		if (!input_pending(fd))
+			queue_op(state, OP_FLUSH);
+	}
+	queue_op(state, OP_FLUSH);
+}
 
-		hd44780_output(state, HD_COMMAND, val);
-		usleep(10000);
+/* Queue characters of a message, turning control codes into blanks. */
+static void
+do_msg_text(struct hd44780_state *state, const uint8_t *s, size_t len)
+{
+	char buf[HD_MAX_CELLS];
+	size_t i;
 
-		val = HD_CMD_DISPCTRL;
-		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
-		val |= HD_DISP_ON;
-		if (state->hd_cursor)
-			val |= HD_CURSOR_ON;
-		if (state->hd_blink)
-			val |= HD_BLINK_ON;
-		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
+	len = MIN(len, sizeof(buf));
+	for (i = 0; i < len; i++)
+		buf[i] = (s[i] < ' ') ? ' ' : s[i];
+	queue_text(state, buf, len);
+}
 
-		val = HD_CMD_ENTRYMODE;
-		val |= HD_ENTRY_INCR;
-		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
-		/* FALLTHROUGH */
+static void
+do_msg(struct hd44780_state *state, const uint8_t *msg)
+{
+	const uint8_t *p = msg + MSG_HDR_LEN;
+	uint8_t bitmap[HD_GLYPH_ROWS];
+	char blanks[HD_MAX_CELLS];
+	int i, len, n, row;
 
-	case CMD_CLR:
-		hd44780_output(state, HD_COMMAND, HD_CMD_CLEAR);
-		usleep(2000);
-		state->hd_col = 0;
-		state->hd_row = 0;
+	len = msg[1];
+	switch (msg[0]) {
+	case MSG_RUN:
+		if (len < 2)
+			break;
+		queue_move(state, p[0], p[1]);
+		do_msg_text(state, p + 2, len - 2);
 		break;
 
-	case CMD_BKSP:
-		if (state->hd_col > 0) {
-			/*
-			 * Move the cursor back, overwrite with a space
-			 * and move back again.
-			 */
-			hd44780_output(state, HD_COMMAND, HD_CMD_MOVE |
-			    HD_MOVE_CURSOR | HD_MOVE_LEFT);
-			state->hd_col--;	/* NB: putc increments hd_col */
-			hd44780_putc(state, ' ');
-			hd44780_output(state, HD_COMMAND, HD_CMD_MOVE |
-			    HD_MOVE_CURSOR | HD_MOVE_LEFT);
-			state->hd_col--;
-		} else {
-			/* XXX */
-			hd44780_command(state, CMD_FLASH);
+	case MSG_FRAME:
+		memset(blanks, ' ', sizeof(blanks));
+		for (row = 0; row < state->hd_lines; row++) {
+			queue_move(state, row, 0);
+			n = MAX(0, MIN(len, state->hd_cols));
+			do_msg_text(state, p, n);
+			queue_text(state, blanks, state->hd_cols - n);
+			p += n;
+			len -= n;
 		}
-		usleep(1000);
 		break;
 
-	case CMD_NL:
-		/*
-		 * Fill the remainder of the current line with spaces.  If there
-		 * is no space for another line, then the cursor is held at the
-		 * end position.  This way no characters will be output until
-		 * the screen is cleared or the cursor is moved otherwise.
-		 */
-		while (state->hd_col < state->hd_cols)	/* NB: putc increments hd_col */
-			hd44780_putc(state, ' ');
-		if (state->hd_row < state->hd_lines - 1) {
-			state->hd_row++;
-			state->hd_col = 0;
-			val = hd44780_calc_addr(state);
-			hd44780_output(state, HD_COMMAND, HD_CMD_SET_ADDR | val);
-			usleep(1000);
-		}
+	case MSG_GLYPH:
+		if (len < 2 + HD_GLYPH_ROWS)
+			break;
+		for (i = 0; i < HD_GLYPH_ROWS; i++)
+			bitmap[i] = p[2 + i] & 0x1f;
+		queue_move(state, p[0], p[1]);
+		queue_glyph(state, bitmap);
 		break;
 
-	case CMD_CR:
-		state->hd_col = 0;
-		val = hd44780_calc_addr(state);
-		hd44780_output(state, HD_COMMAND, HD_CMD_SET_ADDR | val);
-		usleep(1000);
+	case MSG_BACKLIGHT:
+		if (len < 1)
+			break;
+		queue_backlight(state, p[0] != 0);
 		break;
 
-	case CMD_HOME:
-		/* just move to address 0, also resets display shift */
-		hd44780_output(state, HD_COMMAND, HD_CMD_HOME);
-		usleep(2000);
-		state->hd_col = 0;
-		state->hd_row = 0;
+	case MSG_FLUSH:
+		queue_op(state, OP_FLUSH);
 		break;
 
-	case CMD_TAB:
-		i = 8 - state->hd_col % 8;
-		if (state->hd_col + i > state->hd_cols)
-			i = state->hd_cols - state->hd_col;
-		while (i-- > 0)
-			hd44780_putc(state, ' ');
+	default:
+		debug(1, "skipping message of unknown type %d", msg[0]);
 		break;
+	}
+}
 
-	case CMD_FLASH:
-		/* Turn the display off and on a couple of times. */
-		for (i = 0; i < 2; i++) {
-			val = HD_CMD_DISPCTRL;
-			hd44780_output(state, HD_COMMAND, val);
-			usleep(200000);
-			val |= HD_DISP_ON;
-			if (state->hd_cursor)
-				val |= HD_CURSOR_ON;
-			if (state->hd_blink)
-				val |= HD_BLINK_ON;
-			hd44780_output(state, HD_COMMAND, val);
-			if (i < 3)
-				usleep(200000);
-			else
-				usleep(1000);
+/*
+ * Read messages of the binary protocol until end of file.  A message may
+ * arrive in pieces, the rest of the block is kept until it is complete.
+ */
+static void
+do_binary(struct hd44780_state *state, int fd)
+{
+	uint8_t buf[BUFSIZ];
+	size_t have, off;
+	ssize_t n;
+
+	debug(2, "binary protocol");
+	have = 0;
+	while (!quit) {
+		wait_input(state, fd);
+		n = read(fd, buf + have, sizeof(buf) - have);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			warn("read");
+		if (n <= 0)
+			break;
+		if (state->hd_arrival == 0)
+			state->hd_arrival = clock_nsec();
+		have += n;
+
+		for (off = 0; have - off >= MSG_HDR_LEN &&
+		    have - off >= (size_t)MSG_HDR_LEN + buf[off + 1];
+		    off += MSG_HDR_LEN + buf[off + 1])
+			do_msg(state, buf + off);
+		have -= off;
+		memmove(buf, buf + off, have);
+	}
+	if (have != 0)
+		debug(1, "%zu bytes of an incomplete message left", have);
+	queue_op(state, OP_FLUSH);
+}
+
+/*
+ * Wait until there is input on fd, or forever if fd is -1, scrolling the
+ * ticker in the meantime.  Without the ticker this is left to the following
+ * blocking call.  Returns early if interrupted by a signal.
+ */
+static void
+wait_input(struct hd44780_state *state, int fd)
+{
+	struct pollfd pfd;
+	uint64_t now;
+
+	if (state->hd_ticker == 0)
+		return;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!quit) {
+		now = clock_nsec();
+		if (now >= state->hd_next_tick) {
+			queue_op(state, OP_SCROLL);
+			state->hd_next_tick = now + state->hd_ticker;
 		}
-		break;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (state->hd_next_tick - now) / 1000000 + 1) != 0)
+			return;
+	}
+}
 
-	default:
-		if (isprint(cmd)) {
-			warnx("unknown command %c", cmd);
-		} else {
-			warnx("unknown command 0x%x", cmd);
+/*
+ * Process a block of input.  Runs of printable characters are written
+ * in one go, as are runs of backspaces or tabs, everything else goes
+ * through do_char().
+ */
+static void
+do_chars(struct hd44780_state *state, const char *buf, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		for (n = 0; state->hd_esc == ESC_NONE && i + n < len; n++) {
+			if (!isascii(buf[i + n]) || !isprint(buf[i + n]))
+				break;
+		}
+		if (n > 0) {
+			queue_text(state, buf + i, n);
+			continue;
+		}
+		if (state->hd_esc == ESC_NONE &&
+		    (buf[i] == '\b' || buf[i] == '\t')) {
+			for (n = 1; i + n < len && buf[i + n] == buf[i]; n++)
+				continue;
+			queue_command_n(state,
+			    (buf[i] == '\b') ? CMD_BKSP : CMD_TAB, n);
+			continue;
 		}
+		do_char(state, buf[i]);
+		n = 1;
 	}
 }
 
 static void
-hd44780_putc(struct hd44780_state *state, int c)
+do_escape(struct hd44780_state *state, char ch)
 {
-	/*
-	 * Won't print beyond the screen even if there is off-screen DDRAM
-	 * available.
-	 * Screen shift commands are not supported yet.
-	 */
-	if (state->hd_col == state->hd_cols)
-		return;
-	hd44780_output(state, HD_DATA, c);
-	usleep(40);
-	state->hd_col++;
+	uint8_t bitmap[HD_GLYPH_ROWS];
+	char hex[3];
+	int i;
+
+	switch (state->hd_esc) {
+	case ESC_START:
+		state->hd_esc = ESC_NONE;
+		switch(ch) {
+		case 'R':
+			queue_command(state, CMD_RESET);
+			break;
+		case 'H':
+			queue_command(state, CMD_HOME);
+			break;
+		case 'S':
+			queue_op(state, OP_STATS);
+			break;
+		case 'g':
+			state->hd_esc = ESC_GLYPH;
+			state->hd_esc_len = 0;
+			break;
+		case 'b':
+			state->hd_esc = ESC_BAR;
+			break;
+		case '[':
+			state->hd_esc = ESC_CSI;
+			state->hd_esc_len = 0;
+			memset(state->hd_esc_args, 0,
+			    sizeof(state->hd_esc_args));
+			state->hd_esc_priv = false;
+			break;
+		}
+		break;
+
+	case ESC_CSI:
+		if (ch >= '0' && ch <= '9') {
+			i = state->hd_esc_len;
+			if (i < HD_CSI_ARGS && state->hd_esc_args[i] < 1000)
+				state->hd_esc_args[i] =
+				    state->hd_esc_args[i] * 10 + (ch - '0');
+			break;
+		}
+		if (ch == ';') {
+			state->hd_esc_len++;
+			break;
+		}
+		/* Other parameter and intermediate bytes, e.g. <ESC>[?25l. */
+		if (ch >= 0x20 && ch <= 0x3f) {
+			state->hd_esc_priv = true;
+			break;
+		}
+		state->hd_esc = ESC_NONE;
+		if (ch < 0x40 || ch > 0x7e)
+			break;
+		if (!state->hd_esc_priv)
+			do_csi(state, ch);
+		else {
+			debug(1, "unsupported sequence <ESC>[...%c", ch);
+		}
+		break;
+
+	case ESC_GLYPH:
+		if (!isascii(ch) || !isxdigit(ch)) {
+			state->hd_esc = ESC_NONE;
+			break;
+		}
+		state->hd_esc_buf[state->hd_esc_len++] = ch;
+		if (state->hd_esc_len < (int)sizeof(state->hd_esc_buf))
+			break;
+		state->hd_esc = ESC_NONE;
+		hex[2] = '\0';
+		for (i = 0; i < HD_GLYPH_ROWS; i++) {
+			hex[0] = state->hd_esc_buf[2 * i];
+			hex[1] = state->hd_esc_buf[2 * i + 1];
+			bitmap[i] = strtol(hex, NULL, 16) & 0x1f;
+		}
+		queue_glyph(state, bitmap);
+		break;
+
+	case ESC_BAR:
+		state->hd_esc = ESC_NONE;
+		if (ch < '0' || ch > '5')
+			break;
+		/* The leftmost columns lit, the bottom row left as a gap. */
+		memset(bitmap, (0x1f << (5 - (ch - '0'))) & 0x1f,
+		    sizeof(bitmap));
+		bitmap[HD_GLYPH_ROWS - 1] = 0;
+		queue_glyph(state, bitmap);
+		break;
+
+	default:
+		state->hd_esc = ESC_NONE;
+		break;
+	}
+}
+
+/*
+ * The VT100 sequences for placing the cursor and erasing, so that a field
+ * is updated with a single address change instead of a repaint.  Rows and
+ * columns count from 1, and a missing or zero one is taken as 1.  Clearing
+ * the display homes the cursor as \f does.
+ */
+static void
+do_csi(struct hd44780_state *state, char ch)
+{
+	int *args = state->hd_esc_args;
+
+	switch (ch) {
+	case 'H':
+	case 'f':
+		/* Like a terminal, stop at the last row and column. */
+		queue_move(state,
+		    MIN(MAX(args[0], 1), state->hd_lines) - 1,
+		    MIN(MAX(args[1], 1), state->hd_width) - 1);
+		break;
+	case 'K':
+		if (args[0] == 0)
+			queue_command(state, CMD_EOL);
+		break;
+	case 'J':
+		if (args[0] == 2)
+			queue_command(state, CMD_CLR);
+		break;
+	default:
+		debug(1, "unsupported sequence <ESC>[%c", ch);
+		break;
+	}
+}
+
+static void
+do_char(struct hd44780_state *state, char ch)
+{
+
+	if (state->hd_esc != ESC_NONE) {
+		do_escape(state, ch);
+		return;
+	}
+
+	if (ch == 27) {
+		state->hd_esc = ESC_START;
+		return;
+	}
+
+	switch(ch) {
+	case '\n':
+		queue_command(state, CMD_NL);
+		break;
+	case '\r':
+		queue_command(state, CMD_CR);
+		break;
+	case '\t':
+		queue_command(state, CMD_TAB);
+		break;
+	case '\a':
+		queue_command(state, CMD_FLASH);
+		break;
+	case '\b':
+		queue_command(state, CMD_BKSP);
+		break;
+	case '\f':
+		queue_command(state, CMD_CLR);
+		break;
+	default:
+		if (isascii(ch) && isprint(ch))
+			queue_text(state, &ch, 1);
+		break;
+	}
+}
+
+/*
+ * Pass an instruction to the output thread, waiting for it if the ring is
+ * full.  Without an output thread, as in benchmarks, the instruction is
+ * executed right away.
+ */
+static void
+queue_push(struct hd44780_state *state, const struct hd44780_op *op)
+{
+	struct hd44780_queue *q = state->hd_queue;
+
+	if (q == NULL) {
+		(void)hd44780_execute(state, op);
+		return;
+	}
+	while (sem_wait(&q->q_space) == -1)
+		continue;
+	q->q_ops[q->q_head % HD_QUEUE_SIZE] = *op;
+	q->q_head++;
+	sem_post(&q->q_items);
+}
+
+static void
+queue_op(struct hd44780_state *state, enum op_type type)
+{
+	struct hd44780_op op;
+
+	op.op_type = type;
+	if (type == OP_STATS)
+		op.op_fd = state->hd_reply_fd;
+	if (type == OP_FLUSH) {
+		op.op_arrival = state->hd_arrival;
+		state->hd_arrival = 0;
+	}
+	queue_push(state, &op);
+}
+
+static void
+queue_text(struct hd44780_state *state, const char *s, size_t len)
+{
+	struct hd44780_op op;
+	size_t n;
+
+	op.op_type = OP_TEXT;
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, HD_OP_TEXT_MAX);
+		op.op_len = n;
+		memcpy(op.op_text, s, n);
+		queue_push(state, &op);
+	}
+}
+
+static void
+queue_command(struct hd44780_state *state, enum command cmd)
+{
+
+	queue_command_n(state, cmd, 1);
+}
+
+static void
+queue_command_n(struct hd44780_state *state, enum command cmd, int n)
+{
+	struct hd44780_op op;
+
+	op.op_type = OP_COMMAND;
+	op.op_cmd = cmd;
+	op.op_count = n;
+	queue_push(state, &op);
+	if (cmd == CMD_CLR && state->hd_coalesce && state->hd_queue != NULL)
+		atomic_store_explicit(&state->hd_queue->q_clear,
+		    state->hd_queue->q_head - 1, memory_order_release);
+}
+
+static void
+queue_glyph(struct hd44780_state *state, const uint8_t *bitmap)
+{
+	struct hd44780_op op;
+
+	op.op_type = OP_GLYPH;
+	memcpy(op.op_bitmap, bitmap, sizeof(op.op_bitmap));
+	queue_push(state, &op);
+}
+
+static void
+queue_move(struct hd44780_state *state, int row, int col)
+{
+	struct hd44780_op op;
+
+	/* hd44780_move() clamps to the panel, just keep the op fields whole. */
+	op.op_type = OP_MOVE;
+	op.op_row = MIN(row, UINT8_MAX);
+	op.op_col = MIN(col, UINT8_MAX);
+	queue_push(state, &op);
+}
+
+static void
+queue_backlight(struct hd44780_state *state, bool on)
+{
+	struct hd44780_op op;
+
+	op.op_type = OP_BACKLIGHT;
+	op.op_on = on;
+	queue_push(state, &op);
+}
+
+/*
+ * In the latest-wins mode, what is drawn before a clear that is already
+ * queued would not be seen for long, so the output thread skips it.  Only
+ * a clear starts a new screen: after a return home the cells that the new
+ * screen does not overwrite still show the old one.
+ */
+static bool
+queue_superseded(struct hd44780_queue *q)
+{
+	const struct hd44780_op *op = &q->q_ops[q->q_tail % HD_QUEUE_SIZE];
+	unsigned int clear;
+
+	clear = atomic_load_explicit(&q->q_clear, memory_order_acquire);
+	if ((int)(clear - q->q_tail) <= 0)
+		return (false);
+
+	switch (op->op_type) {
+	case OP_TEXT:
+	case OP_GLYPH:
+	case OP_MOVE:
+	case OP_FLUSH:
+		return (true);
+	case OP_COMMAND:
+		return (op->op_cmd != CMD_RESET);
+	default:
+		return (false);
+	}
+}
+
+/* Wait until the output thread has executed everything queued so far. */
+static void
+queue_sync(struct hd44780_state *state)
+{
+
+	if (state->hd_queue == NULL)
+		return;
+	queue_op(state, OP_SYNC);
+	while (sem_wait(&state->hd_queue->q_synced) == -1)
+		continue;
+}
+
+/*
+ * Execute an instruction from the parser.  Returns false at the end of
+ * the input.
+ */
+static bool
+hd44780_execute(struct hd44780_state *state, const struct hd44780_op *op)
+{
+
+	switch (op->op_type) {
+	case OP_TEXT:
+		hd44780_puts(state, op->op_text, op->op_len);
+		break;
+	case OP_COMMAND:
+		hd44780_command_n(state, op->op_cmd, op->op_count);
+		break;
+	case OP_GLYPH:
+		hd44780_put_glyph(state, op->op_bitmap);
+		break;
+	case OP_MOVE:
+		hd44780_move(state, op->op_row, op->op_col);
+		break;
+	case OP_BACKLIGHT:
+		hd44780_backlight(state, op->op_on);
+		break;
+	case OP_FLUSH:
+		/* Left to the refresh in the output thread, if rate limited. */
+		if (state->hd_refresh == 0 || state->hd_queue == NULL) {
+			hd44780_flush(state);
+			hd44780_latency(state, op->op_arrival);
+		} else if (state->hd_flush_arrival == 0) {
+			state->hd_flush_arrival = op->op_arrival;
+		}
+		break;
+	case OP_SCROLL:
+		hd44780_scroll(state);
+		break;
+	case OP_STATS:
+		hd44780_print_stats(state, op->op_fd);
+		break;
+	case OP_SYNC:
+		sem_post(&state->hd_queue->q_synced);
+		break;
+	case OP_STOP:
+		hd44780_flush(state);
+		hd44780_latency(state, state->hd_flush_arrival);
+		hd44780_flash_end(state);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Sleeping is only as precise as the scheduler allows, so short delays
+ * are done by spinning on the clock and long ones by sleeping most of the
+ * time and spinning for the rest.  The sleep overshoot is measured at
+ * startup.
+ */
+#define	DELAY_CALIBRATE_RUNS	8
+#define	DELAY_MAX_SPIN		USEC(2000)
+
+static uint32_t	delay_slack;
+
+static uint64_t
+clock_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+delay_init(void)
+{
+	uint64_t start, elapsed;
+	int i;
+
+	delay_slack = 0;
+	for (i = 0; i < DELAY_CALIBRATE_RUNS; i++) {
+		start = clock_nsec();
+		usleep(1);
+		elapsed = clock_nsec() - start;
+		if (elapsed > delay_slack)
+			delay_slack = elapsed;
+	}
+	if (delay_slack > DELAY_MAX_SPIN)
+		delay_slack = DELAY_MAX_SPIN;
+	debug(2, "sleep overshoot is %u ns", delay_slack);
+}
+
+static void
+delay(uint32_t nsec)
+{
+	uint64_t deadline;
+
+	if (nsec == 0)
+		return;
+	deadline = clock_nsec() + nsec;
+	if (nsec > delay_slack)
+		usleep((nsec - delay_slack) / 1000);
+	while (clock_nsec() < deadline)
+		continue;
+}
+
+static int
+hd44780_ioctl(struct hd44780_state *state, unsigned long cmd, void *arg)
+{
+	uint64_t t;
+	int error, saved_errno;
+
+	state->hd_stats.st_ioctls++;
+	if (trace == NULL)
+		return (state->hd_backend->bk_ioctl(state, cmd, arg));
+	t = clock_nsec();
+	error = state->hd_backend->bk_ioctl(state, cmd, arg);
+	if (error == 0) {
+		trace_ioctl(state, t, cmd, arg);
+	} else {
+		/* The callers report errno. */
+		saved_errno = errno;
+		trace_event(state, t, "error %d", saved_errno);
+		errno = saved_errno;
+	}
+	return (error);
+}
+
+static void
+hd44780_delay(struct hd44780_state *state, uint32_t nsec)
+{
+	uint64_t start;
+
+	start = clock_nsec();
+	delay(nsec);
+	state->hd_stats.st_delay_ns += clock_nsec() - start;
+}
+
+static void
+hd44780_set_pin(struct hd44780_state *state, enum hd_pin_id pin, bool on)
+{
+	struct gpio_req req;
+	int err;
+
+	assert(state->pins[pin] != -1);
+	if ((state->hd_pin_known & HD_PIN_MASK(pin)) != 0 &&
+	    ((state->hd_pin_values & HD_PIN_MASK(pin)) != 0) == on)
+		return;
+
+	req.gp_pin = state->pins[pin];
+	req.gp_value = on;
+	err = hd44780_ioctl(state, GPIOSET, &req);
+	if (err != 0) {
+		debug(1, "%s: error %d", __func__, errno);
+		state->hd_pin_known &= ~HD_PIN_MASK(pin);
+		return;
+	}
+	state->hd_pin_known |= HD_PIN_MASK(pin);
+	if (on)
+		state->hd_pin_values |= HD_PIN_MASK(pin);
+	else
+		state->hd_pin_values &= ~HD_PIN_MASK(pin);
+}
+
+static bool
+hd44780_get_pin(struct hd44780_state *state, enum hd_pin_id pin)
+{
+	struct gpio_req req;
+	int err;
+
+	assert(state->pins[pin] != -1);
+	req.gp_pin = state->pins[pin];
+	req.gp_value = 0;
+	err = hd44780_ioctl(state, GPIOGET, &req);
+	if (err != 0)
+		debug(1, "%s: error %d", __func__, errno);
+	return (req.gp_value != 0);
+}
+
+/*
+ * Latch what is on the bus with a pulse on E.  A transfer takes three
+ * requests to the backend then, for the lines, E up and E down, with the
+ * delays between them timed here.  gpioc(4) has no request that plays
+ * back a timed sequence of pin changes, so a transfer cannot be handed to
+ * the kernel in one call.  Where the ioctls cost too much, the register
+ * backends do the same with stores.
+ */
+static void
+hd44780_strobe(struct hd44780_state *state)
+{
+
+	state->hd_stats.st_strobes++;
+	hd44780_delay(state, state->hd_timing->t_setup);
+	hd44780_set_pin(state, HD_PIN_E, true);
+	hd44780_delay(state, state->hd_timing->t_pulse);
+	hd44780_set_pin(state, HD_PIN_E, false);
+	hd44780_delay(state, state->hd_timing->t_hold);
+}
+
+/*
+ * Set several pins at once.  Both the mask and the values are bit sets of
+ * enum hd_pin_id.  Pins that are known to already have the requested
+ * values are skipped.  If all pins live in the same bank and the controller
+ * supports GPIOACCESS32, then all pins are changed with a single ioctl.
+ * Otherwise, or if the bulk access fails, fall back to setting one pin at
+ * a time.
+ */
+static void
+hd44780_set_pins(struct hd44780_state *state, uint32_t mask, uint32_t values)
+{
+	struct gpio_access_32 acc;
+	uint32_t bit;
+	int err, i;
+
+	mask &= ~state->hd_pin_known | (values ^ state->hd_pin_values);
+	if (mask == 0)
+		return;
+
+	if (state->hd_bulk) {
+		acc.first_pin = state->hd_bank;
+		acc.clear_pins = 0;
+		acc.change_pins = 0;
+		for (i = 0; i < HD_PIN_COUNT; i++) {
+			if ((mask & HD_PIN_MASK(i)) == 0)
+				continue;
+			assert(state->pins[i] != -1);
+			bit = 1u << (state->pins[i] - state->hd_bank);
+			acc.clear_pins |= bit;
+			if ((values & HD_PIN_MASK(i)) != 0)
+				acc.change_pins |= bit;
+		}
+		err = hd44780_ioctl(state, GPIOACCESS32, &acc);
+		if (err == 0) {
+			state->hd_pin_known |= mask;
+			state->hd_pin_values = (state->hd_pin_values & ~mask) |
+			    (values & mask);
+			return;
+		}
+		debug(1, "%s: error %d, falling back to per-pin access",
+		    __func__, errno);
+		state->hd_bulk = false;
+	}
+
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((mask & HD_PIN_MASK(i)) == 0)
+			continue;
+		hd44780_set_pin(state, i, (values & HD_PIN_MASK(i)) != 0);
+	}
+}
+
+/*
+ * Put a word on the data lines together with the register select and then
+ * latch it.  The word is a nibble for DB4-DB7 with the 4-bit interface and
+ * a full byte for DB0-DB7 with the 8-bit interface.
+ */
+static void
+hd44780_output_bus(struct hd44780_state *state, enum reg_type type,
+    uint8_t bits)
+{
+	struct gpio_access_32 acc;
+	uint32_t mask, values;
+
+	/* The data pins are the first ids, so the word maps to them as is. */
+	mask = HD_PIN_MASK(HD_PIN_RW) | HD_PIN_MASK(HD_PIN_RS) |
+	    HD_DATA_PINS(state);
+	if (state->pins[HD_PIN_RW] == -1)
+		mask &= ~HD_PIN_MASK(HD_PIN_RW);
+	values = (uint32_t)bits << HD_PIN_DAT0;
+	if (type == HD_DATA)
+		values |= HD_PIN_MASK(HD_PIN_RS);
+
+	/* R/W is still high after a read, so the controller is not driving. */
+	hd44780_config_data_pins(state, GPIO_PIN_OUTPUT);
+	if (!state->hd_bulk || !state->hd_lut_ready) {
+		hd44780_set_pins(state, mask, values);
+	} else if ((state->hd_pin_known & mask) != mask ||
+	    (state->hd_pin_values & mask) != values) {
+		acc.first_pin = state->hd_bank;
+		acc.clear_pins = state->hd_lut_clear;
+		acc.change_pins = state->hd_lut[type][bits];
+		if (hd44780_ioctl(state, GPIOACCESS32, &acc) == 0) {
+			state->hd_pin_known |= mask;
+			state->hd_pin_values = (state->hd_pin_values & ~mask) |
+			    values;
+		} else {
+			debug(1, "%s: error %d, falling back to per-pin access",
+			    __func__, errno);
+			state->hd_bulk = false;
+			hd44780_set_pins(state, mask, values);
+		}
+	}
+
+	hd44780_strobe(state);
+}
+
+/*
+ * Read several pins at once.  The mask and the result are bit sets of
+ * enum hd_pin_id.
+ */
+static uint32_t
+hd44780_get_pins(struct hd44780_state *state, uint32_t mask)
+{
+	struct gpio_access_32 acc;
+	uint32_t values;
+	int err, i;
+
+	values = 0;
+	if (state->hd_bulk) {
+		acc.first_pin = state->hd_bank;
+		acc.clear_pins = 0;
+		acc.change_pins = 0;
+		err = hd44780_ioctl(state, GPIOACCESS32, &acc);
+		if (err == 0) {
+			for (i = 0; i < HD_PIN_COUNT; i++) {
+				if ((mask & HD_PIN_MASK(i)) == 0)
+					continue;
+				if ((acc.orig_pins &
+				    (1u << (state->pins[i] - state->hd_bank))) != 0)
+					values |= HD_PIN_MASK(i);
+			}
+			return (values);
+		}
+		debug(1, "%s: error %d, falling back to per-pin access",
+		    __func__, errno);
+		state->hd_bulk = false;
+	}
+
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((mask & HD_PIN_MASK(i)) == 0)
+			continue;
+		if (hd44780_get_pin(state, i))
+			values |= HD_PIN_MASK(i);
+	}
+	return (values);
+}
+
+static void
+hd44780_config_data_pins(struct hd44780_state *state, uint32_t flags)
+{
+	struct gpio_pin cfg;
+	int error, i;
+
+	if (state->hd_data_dir == flags)
+		return;
+	state->hd_data_dir = flags;
+	for (i = 0; i < state->hd_ifwidth; i++) {
+		cfg.gp_pin = state->pins[HD_PIN_DAT0 + i];
+		cfg.gp_flags = flags;
+		error = hd44780_ioctl(state, GPIOSETCONFIG, &cfg);
+		if (error != 0)
+			err(1, "configuring pin %d failed", cfg.gp_pin);
+
+		/* Do not assume that the output value survives this. */
+		state->hd_pin_known &= ~HD_PIN_MASK(HD_PIN_DAT0 + i);
+	}
+}
+
+/*
+ * Take the bus for a transfer.  Another display may have changed the
+ * shared pins in the meantime, so forget what is known about them.
+ */
+static void
+hd44780_bus_lock(struct hd44780_state *state)
+{
+	struct hd44780_bus *bus = state->hd_bus;
+
+	pthread_mutex_lock(&bus->b_lock);
+	if (bus->b_owner != state) {
+		bus->b_owner = state;
+		state->hd_pin_known &= ~state->hd_pin_shared;
+		if ((state->hd_pin_shared & HD_DATA_PINS(state)) != 0)
+			state->hd_data_dir = 0;
+	}
+}
+
+static void
+hd44780_bus_unlock(struct hd44780_state *state)
+{
+
+	pthread_mutex_unlock(&state->hd_bus->b_lock);
+}
+
+/*
+ * Read a byte from the controller, sampling only the data lines of the
+ * bits asked for.  The data pins are switched to input before R/W is
+ * raised, so that the GPIO and the controller never drive the lines at
+ * the same time.  They are left so, as a busy flag poll reads again and
+ * again, and only switched back to output by the next write.
+ */
+static uint8_t
+hd44780_read(struct hd44780_state *state, enum reg_type type, uint8_t bits)
+{
+	uint32_t mask, values;
+	uint8_t data;
+	int i, n, xfers;
+
+	hd44780_bus_lock(state);
+	hd44780_config_data_pins(state, GPIO_PIN_INPUT);
+
+	values = HD_PIN_MASK(HD_PIN_RW);
+	if (type == HD_DATA)
+		values |= HD_PIN_MASK(HD_PIN_RS);
+	hd44780_set_pins(state, HD_PIN_MASK(HD_PIN_RW) | HD_PIN_MASK(HD_PIN_RS),
+	    values);
+	hd44780_delay(state, state->hd_timing->t_setup);
+
+	/* With the 4-bit interface upper nibble first, then lower nibble. */
+	xfers = (state->hd_ifwidth == 8) ? 1 : 2;
+	data = 0;
+	for (n = 0; n < xfers; n++) {
+		mask = (state->hd_ifwidth == 8) ? bits :
+		    (n == 0) ? bits >> 4 : bits & 0x0f;
+		hd44780_set_pin(state, HD_PIN_E, true);
+		hd44780_delay(state, state->hd_timing->t_pulse);
+		values = (mask != 0) ?
+		    hd44780_get_pins(state, mask << HD_PIN_DAT0) : 0;
+		hd44780_set_pin(state, HD_PIN_E, false);
+		hd44780_delay(state, state->hd_timing->t_hold);
+		data <<= 4;
+		for (i = 0; i < state->hd_ifwidth; i++) {
+			if ((values & HD_PIN_MASK(HD_PIN_DAT0 + i)) != 0)
+				data |= 1 << i;
+		}
+	}
+
+	hd44780_bus_unlock(state);
+	state->hd_stats.st_reads++;
+
+	debug(4, "%s <- 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	return (data);
+}
+
+static uint8_t
+hd44780_input(struct hd44780_state *state, enum reg_type type)
+{
+
+	return (hd44780_read(state, type, 0xff));
+}
+
+static void
+hd44780_output(struct hd44780_state *state, enum reg_type type, uint8_t data)
+{
+	uint64_t t;
+
+	t = clock_nsec();
+	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	if (trace != NULL)
+		trace_event(state, t, "%s 0x%02x",
+		    (type == HD_COMMAND) ? "cmd" : "data", data);
+	state->hd_stats.st_bytes[type]++;
+	hd44780_track_addr(state, type, data);
+
+	hd44780_bus_lock(state);
+	if (state->hd_ifwidth == 8) {
+		hd44780_output_bus(state, type, data);
+	} else {
+		/* Upper nibble first, then lower nibble. */
+		hd44780_output_bus(state, type, data >> 4);
+		hd44780_output_bus(state, type, data & 0x0f);
+	}
+	hd44780_bus_unlock(state);
+	hist_record(&state->hd_stats.st_output, clock_nsec() - t);
+}
+
+/*
+ * Do a single transfer as used during the initialization when the width
+ * of the interface is not known to the controller yet.  This is the upper
+ * nibble of the data with the 4-bit interface.
+ */
+static void
+hd44780_output4(struct hd44780_state *state, enum reg_type type, uint8_t data)
+{
+
+	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+
+	hd44780_bus_lock(state);
+	if (state->hd_ifwidth == 8)
+		hd44780_output_bus(state, type, data);
+	else
+		hd44780_output_bus(state, type, data >> 4);
+	hd44780_bus_unlock(state);
+}
+
+/*
+ * With the bulk access, compute the bank words of RS and the data lines
+ * for all words that can be written up front.  Then a transfer is a table
+ * lookup and a single GPIOACCESS32, whatever the pin layout is.
+ */
+static void
+hd44780_setup_lut(struct hd44780_state *state)
+{
+	uint32_t word;
+	int bits, i, type;
+
+#define	BANK_BIT(id)	(1u << (state->pins[id] - state->hd_bank))
+	state->hd_lut_clear = BANK_BIT(HD_PIN_RS);
+	if (state->pins[HD_PIN_RW] != -1)
+		state->hd_lut_clear |= BANK_BIT(HD_PIN_RW);
+	for (i = 0; i < state->hd_ifwidth; i++)
+		state->hd_lut_clear |= BANK_BIT(HD_PIN_DAT0 + i);
+
+	for (type = HD_COMMAND; type <= HD_DATA; type++) {
+		for (bits = 0; bits < (1 << state->hd_ifwidth); bits++) {
+			word = (type == HD_DATA) ? BANK_BIT(HD_PIN_RS) : 0;
+			for (i = 0; i < state->hd_ifwidth; i++) {
+				if ((bits & (1 << i)) != 0)
+					word |= BANK_BIT(HD_PIN_DAT0 + i);
+			}
+			state->hd_lut[type][bits] = word;
+		}
+	}
+#undef	BANK_BIT
+	state->hd_lut_ready = true;
+}
+
+/*
+ * Check if all configured pins are in the same bank, so that they can be
+ * accessed with GPIOACCESS32.  Whether the controller actually supports
+ * that is found out on the first access.
+ */
+static void
+hd44780_setup_bulk(struct hd44780_state *state)
+{
+	int i;
+
+	state->hd_bulk = false;
+	state->hd_bank = state->pins[HD_PIN_E] - state->pins[HD_PIN_E] % HD_BANK_SIZE;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pins[i] == -1)
+			continue;
+		if (state->pins[i] < state->hd_bank ||
+		    state->pins[i] >= state->hd_bank + HD_BANK_SIZE) {
+			debug(1, "pins span multiple banks, using per-pin access");
+			return;
+		}
+	}
+	state->hd_bulk = true;
+}
+
+static void
+hd44780_prepare(struct hd44780_state *state)
+{
+	struct gpio_pin cfg;
+	uint32_t configured, mask;
+	int error, i;
+
+	if (state->hd_backend->bk_open(state, state->hd_devname) == -1)
+		err(EX_OSFILE, "can't open '%s'", state->hd_devname);
+	state->hd_open = true;
+
+	/* With the fast start leave alone the pins that are outputs already. */
+	configured = 0;
+	for (i = 0; i < HD_PIN_COUNT && state->hd_fast_start; i++) {
+		if (state->pins[i] == -1)
+			continue;
+		cfg.gp_pin = state->pins[i];
+		if (hd44780_ioctl(state, GPIOGETCONFIG, &cfg) == 0 &&
+		    (cfg.gp_flags & (GPIO_PIN_INPUT | GPIO_PIN_OUTPUT)) ==
+		    GPIO_PIN_OUTPUT)
+			configured |= HD_PIN_MASK(i);
+	}
+
+	/*
+	 * Before anything else set E as input to avoid triggering
+	 * it as a possible side-effect of changing other pins.
+	 */
+	if ((configured & HD_PIN_MASK(HD_PIN_E)) == 0) {
+		cfg.gp_pin = state->pins[HD_PIN_E];
+		cfg.gp_flags = GPIO_PIN_INPUT;
+		error = hd44780_ioctl(state, GPIOSETCONFIG, &cfg);
+		if (error != 0)
+			err(1, "configuring pin %d as input failed",
+			    cfg.gp_pin);
+	}
+
+	/* Configure GPIO pins. */
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pins[i] == -1 ||
+		    (configured & HD_PIN_MASK(i)) != 0)
+			continue;
+		cfg.gp_pin = state->pins[i];
+		cfg.gp_flags = GPIO_PIN_INPUT;
+		(void)hd44780_ioctl(state, GPIOSETCONFIG, &cfg);
+	}
+
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pins[i] == -1 ||
+		    (configured & HD_PIN_MASK(i)) != 0)
+			continue;
+		cfg.gp_pin = state->pins[i];
+		cfg.gp_flags = GPIO_PIN_OUTPUT;
+		error = hd44780_ioctl(state, GPIOSETCONFIG, &cfg);
+		if (error != 0)
+			err(1, "configuring pin %d as output failed",
+			    cfg.gp_pin);
+	}
+
+	/*
+	 * Drive all pins low.  This is also the first bulk access, so if
+	 * the controller does not support it then we learn that here.
+	 */
+	hd44780_setup_bulk(state);
+	mask = 0;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pins[i] == -1)
+			continue;
+		mask |= HD_PIN_MASK(i);
+	}
+	hd44780_set_pins(state, mask, 0);
+	state->hd_data_dir = GPIO_PIN_OUTPUT;
+	debug(2, "using %s pin access", state->hd_bulk ? "bulk" : "per-pin");
+	if (state->hd_bulk)
+		hd44780_setup_lut(state);
+}
+
+/*
+ * Initialize the controller.  The pins of all displays are configured
+ * before, so this can be done for the displays on a shared bus at the
+ * same time, by their workers.
+ */
+static void
+hd44780_start(struct hd44780_state *state)
+{
+
+	state->hd_ac = -1;
+	if (state->hd_fast_start) {
+		/*
+		 * The display is as an earlier run left it, so the first
+		 * flush or newline redraws every cell.
+		 */
+		debug(2, "assuming that the controller is initialized");
+		memset(state->hd_shadow, HD_CELL_UNKNOWN,
+		    sizeof(state->hd_shadow));
+		memset(state->hd_frame, ' ', sizeof(state->hd_frame));
+	} else {
+		/* Reading the controller back tells if it is powered up. */
+		state->hd_if_ready = state->hd_busy_poll &&
+		    hd44780_check_init(state);
+		if (!state->hd_if_ready)
+			hd44780_delay(state, state->hd_timing->t_power);
+		hd44780_command(state, CMD_RESET);
+	}
+
+	if (state->hd_bl_on) {
+		hd44780_bus_lock(state);
+		hd44780_set_pin(state, HD_PIN_BL, true);
+		hd44780_bus_unlock(state);
+	}
+}
+
+static void
+hd44780_finish(void)
+{
+	struct hd44780_state *state;
+	int i;
+
+	if (print_stats)
+		display_stats(STDERR_FILENO);
+	for (i = 0; i < ndisplays; i++) {
+		state = displays[i];
+		if (state->hd_sfd != -1) {
+			close(state->hd_sfd);
+			(void)unlink(state->hd_sockpath);
+		}
+		if (state->hd_open)
+			state->hd_backend->bk_close(state);
+	}
+	if (trace != NULL)
+		fclose(trace);
+}
+
+/*
+ * The counters are read without locking, while the workers update them,
+ * so the numbers of a running display are not necessarily consistent.
+ */
+static void
+display_stats(int fd)
+{
+	int i;
+
+	for (i = 0; i < ndisplays; i++) {
+		if (ndisplays > 1)
+			dprintf(fd, "display %d:\n", i);
+		hd44780_print_stats(displays[i], fd);
+	}
+}
+
+static void
+hd44780_print_stats(struct hd44780_state *state, int fd)
+{
+	struct hd44780_stats *st = &state->hd_stats;
+	const struct {
+		const char	*name;
+		const struct hd44780_hist *hist;
+	} hists[] = {
+		{ "latency", &st->st_latency },
+		{ "frame", &st->st_frame },
+		{ "output", &st->st_output },
+	};
+	const struct hd44780_hist *h;
+	int i;
+
+	dprintf(fd, "%ju ioctls, %ju strobes, %ju reads\n",
+	    (uintmax_t)st->st_ioctls, (uintmax_t)st->st_strobes,
+	    (uintmax_t)st->st_reads);
+	dprintf(fd, "%ju command bytes, %ju data bytes\n",
+	    (uintmax_t)st->st_bytes[HD_COMMAND],
+	    (uintmax_t)st->st_bytes[HD_DATA]);
+	dprintf(fd, "%ju glyph uploads\n", (uintmax_t)st->st_glyph_loads);
+	dprintf(fd, "%ju instructions skipped\n", (uintmax_t)st->st_skipped);
+	dprintf(fd, "%ju.%06ju s in delays\n",
+	    (uintmax_t)(st->st_delay_ns / 1000000000),
+	    (uintmax_t)(st->st_delay_ns % 1000000000 / 1000));
+	for (i = 0; i < CMD_COUNT; i++) {
+		if (st->st_cmds[i] == 0)
+			continue;
+		dprintf(fd, "%-6s %10ju times %10ju us\n", cmd_names[i],
+		    (uintmax_t)st->st_cmds[i],
+		    (uintmax_t)(st->st_cmd_ns[i] / 1000));
+	}
+	for (i = 0; i < (int)nitems(hists); i++) {
+		h = hists[i].hist;
+		if (h->h_count == 0)
+			continue;
+		dprintf(fd, "%-7s %9ju times, us: mean %ju p50 %ju p90 %ju "
+		    "p99 %ju p99.9 %ju max %ju\n", hists[i].name,
+		    (uintmax_t)h->h_count,
+		    (uintmax_t)(h->h_sum / h->h_count / 1000),
+		    (uintmax_t)(hist_percentile(h, 0.5) / 1000),
+		    (uintmax_t)(hist_percentile(h, 0.9) / 1000),
+		    (uintmax_t)(hist_percentile(h, 0.99) / 1000),
+		    (uintmax_t)(hist_percentile(h, 0.999) / 1000),
+		    (uintmax_t)(h->h_max / 1000));
+	}
+}
+
+/* Record the time from the arrival of input until it is on the display. */
+static void
+hd44780_latency(struct hd44780_state *state, uint64_t arrival)
+{
+
+	if (arrival != 0)
+		hist_record(&state->hd_stats.st_latency,
+		    clock_nsec() - arrival);
+}
+
+/*
+ * The bucket of a value keeps its HIST_SUB_BITS bits below the highest
+ * one set, and the position of that bit.  Values below HIST_SUB have
+ * buckets of their own.
+ */
+static void
+hist_record(struct hd44780_hist *h, uint64_t v)
+{
+	int idx, shift;
+
+	shift = flsll(v) - 1 - HIST_SUB_BITS;
+	if (shift < 0)
+		idx = v;
+	else
+		idx = MIN((shift + 1) * HIST_SUB + (int)((v >> shift) &
+		    (HIST_SUB - 1)), HIST_BUCKETS - 1);
+	h->h_buckets[idx]++;
+	h->h_count++;
+	h->h_sum += v;
+	h->h_max = MAX(h->h_max, v);
+}
+
+/* The highest value in the bucket of the percentile, or the maximum. */
+static uint64_t
+hist_percentile(const struct hd44780_hist *h, double p)
+{
+	uint64_t n, seen;
+	int idx, shift;
+
+	n = (uint64_t)(p * h->h_count + 0.5);
+	seen = 0;
+	for (idx = 0; idx < HIST_BUCKETS - 1; idx++) {
+		seen += h->h_buckets[idx];
+		if (seen >= n && seen > 0)
+			break;
+	}
+	if (idx < HIST_SUB)
+		return (MIN((uint64_t)idx, h->h_max));
+	shift = idx / HIST_SUB - 1;
+	return (MIN((((uint64_t)HIST_SUB + idx % HIST_SUB + 1) << shift) - 1,
+	    h->h_max));
+}
+
+/*
+ * The trace has a line for each byte and each GPIO request: the time in
+ * seconds since the start, the display and the event.
+ */
+static void
+trace_event(struct hd44780_state *state, uint64_t t, const char *fmt, ...)
+{
+	va_list ap;
+
+	t -= trace_start;
+	flockfile(trace);
+	fprintf(trace, "%ju.%09ju %d ", (uintmax_t)(t / 1000000000),
+	    (uintmax_t)(t % 1000000000), state->hd_num);
+	va_start(ap, fmt);
+	vfprintf(trace, fmt, ap);
+	va_end(ap);
+	fputc('\n', trace);
+	funlockfile(trace);
+}
+
+static void
+trace_ioctl(struct hd44780_state *state, uint64_t t, unsigned long cmd,
+    const void *arg)
+{
+	const struct gpio_access_32 *acc;
+	const struct gpio_pin *cfg;
+	const struct gpio_req *req;
+
+	switch (cmd) {
+	case GPIOGETCONFIG:
+	case GPIOSETCONFIG:
+		cfg = arg;
+		trace_event(state, t, "%s %u 0x%x",
+		    (cmd == GPIOGETCONFIG) ? "getconfig" : "setconfig",
+		    cfg->gp_pin, cfg->gp_flags);
+		break;
+	case GPIOGET:
+	case GPIOSET:
+		req = arg;
+		trace_event(state, t, "%s %u %u",
+		    (cmd == GPIOGET) ? "get" : "set", req->gp_pin,
+		    req->gp_value);
+		break;
+	case GPIOACCESS32:
+		acc = arg;
+		trace_event(state, t, "access32 %u 0x%08x 0x%08x 0x%08x",
+		    acc->first_pin, acc->orig_pins, acc->clear_pins,
+		    acc->change_pins);
+		break;
+	}
+}
+
+/*
+ * Check by reading the address counter back whether the controller has
+ * been set up for the configured interface and number of lines, as by an
+ * earlier run.  With another data width or out of step nibbles the reads
+ * return something else.  A data read from the end of the first line moves
+ * the address counter to the second line in the 2-line mode only.  The
+ * font and the display control can not be read and are set anyway.
+ */
+static bool
+hd44780_check_init(struct hd44780_state *state)
+{
+	uint8_t expect, val;
+
+	val = hd44780_input(state, HD_COMMAND);
+	if ((val & HD_STATUS_BUSY) != 0)
+		return (false);
+	/* Wait after each nibble, in case it is taken for an instruction. */
+	val = HD_CMD_SET_ADDR | (HD_LINE_DRAM_SIZE - 1);
+	hd44780_output4(state, HD_COMMAND, val);
+	hd44780_delay(state, state->hd_timing->t_exec);
+	if (state->hd_ifwidth == 4) {
+		hd44780_output4(state, HD_COMMAND, val << 4);
+		hd44780_delay(state, state->hd_timing->t_exec);
+	}
+	(void)hd44780_input(state, HD_DATA);
+	hd44780_delay(state, state->hd_timing->t_exec);
+	val = hd44780_input(state, HD_COMMAND);
+	state->hd_ac = -1;
+
+	expect = (state->hd_lines == 1) ?
+	    HD_LINE_DRAM_SIZE : HD_LINE1_DRAM_OFFSET;
+	debug(2, "address counter 0x%02x, expected 0x%02x", val, expect);
+	return (val == expect);
+}
+
+/* Give up on the busy flag if it does not clear after this many reads. */
+#define	HD_BUSY_POLL_MAX		1000
+
+/*
+ * Wait for completion of an instruction that takes up to nsec
+ * nanoseconds.  If the busy flag polling is enabled, then wait only
+ * as long as the controller reports that it is busy.
+ */
+static void
+hd44780_wait(struct hd44780_state *state, uint32_t nsec)
+{
+	int i;
+
+	if (state->hd_busy_poll) {
+		for (i = 0; i < HD_BUSY_POLL_MAX; i++) {
+			if ((hd44780_read(state, HD_COMMAND, HD_STATUS_BUSY) &
+			    HD_STATUS_BUSY) == 0)
+				return;
+		}
+		warnx("busy flag does not clear, using fixed delays");
+		state->hd_busy_poll = false;
+	}
+	hd44780_delay(state, nsec);
+}
+
+static uint8_t
+hd44780_cell_addr(struct hd44780_state *state, int row, int col)
+{
+	uint8_t addr;
+
+	addr = col;
+	if (row == 1 || row == 3)
+		addr += HD_LINE1_DRAM_OFFSET;
+	if (row == 2 || row == 3)
+		addr += state->hd_cols;
+	return (addr);
+}
+
+static uint8_t
+hd44780_calc_addr(struct hd44780_state *state)
+{
+
+	return (hd44780_cell_addr(state, state->hd_row, state->hd_col));
+}
+
+/*
+ * Move a DDRAM address by one position the way the address counter does.
+ * In the 2-line mode each line has its own range of addresses and the
+ * counter jumps from the end of one line to the start of the other.
+ */
+static int
+hd44780_step_addr(int addr, bool twolines, bool incr)
+{
+	int last;
+
+	last = twolines ? HD_LINE1_DRAM_OFFSET + HD_LINE_DRAM_SIZE - 1 :
+	    2 * HD_LINE_DRAM_SIZE - 1;
+	if (incr) {
+		if (addr == last)
+			return (0);
+		if (twolines && addr == HD_LINE_DRAM_SIZE - 1)
+			return (HD_LINE1_DRAM_OFFSET);
+		return (addr + 1);
+	}
+	if (addr == 0)
+		return (last);
+	if (twolines && addr == HD_LINE1_DRAM_OFFSET)
+		return (HD_LINE_DRAM_SIZE - 1);
+	return (addr - 1);
+}
+
+/*
+ * Follow the effect of everything written to the controller on its address
+ * counter.  The driver always uses the incrementing entry mode.
+ */
+static void
+hd44780_track_addr(struct hd44780_state *state, enum reg_type type,
+    uint8_t data)
+{
+	bool twolines;
+
+	twolines = state->hd_lines != 1;
+	if (type == HD_DATA) {
+		if (state->hd_ac != -1)
+			state->hd_ac = hd44780_step_addr(state->hd_ac, twolines,
+			    true);
+	} else if ((data & HD_CMD_SET_ADDR) != 0) {
+		state->hd_ac = data & ~HD_CMD_SET_ADDR;
+	} else if ((data & HD_CMD_SET_CGADDR) != 0) {
+		state->hd_ac = -1;
+	} else if ((data & (HD_CMD_SETMODE | HD_CMD_MOVE)) == HD_CMD_MOVE) {
+		if ((data & HD_MOVE_DISP) == 0 && state->hd_ac != -1)
+			state->hd_ac = hd44780_step_addr(state->hd_ac, twolines,
+			    (data & HD_MOVE_RIGHT) != 0);
+	} else if ((data & ~(HD_CMD_HOME | HD_CMD_CLEAR)) == 0 && data != 0) {
+		state->hd_ac = 0;
+	}
+}
+
+/* Point the address counter at addr unless it is already there. */
+static void
+hd44780_set_addr(struct hd44780_state *state, uint8_t addr)
+{
+
+	if (state->hd_ac == addr)
+		return;
+	hd44780_output(state, HD_COMMAND, HD_CMD_SET_ADDR | addr);
+	hd44780_wait(state, state->hd_timing->t_exec);
+}
+
+/*
+ * Find a CGRAM slot holding the glyph, uploading it if needed.  When all
+ * slots are taken, the least recently used glyph that is not on the screen
+ * is replaced, so that no visible character changes its look.  Only if
+ * every glyph is on the screen one of them has to go.
+ */
+static int
+hd44780_glyph_slot(struct hd44780_state *state, const uint8_t *bitmap)
+{
+	struct hd44780_glyph *g;
+	const uint8_t *cells;
+	bool visible[HD_GLYPHS];
+	int i, slot;
+
+	state->hd_glyph_clock++;
+	for (i = 0; i < HD_GLYPHS; i++) {
+		g = &state->hd_glyphs[i];
+		if (g->g_loaded &&
+		    memcmp(g->g_bitmap, bitmap, sizeof(g->g_bitmap)) == 0) {
+			g->g_used = state->hd_glyph_clock;
+			return (i);
+		}
+	}
+
+	memset(visible, 0, sizeof(visible));
+	cells = state->hd_frame_mode ? state->hd_frame : state->hd_shadow;
+	for (i = 0; i < state->hd_lines * state->hd_width; i++) {
+		if (cells[i] < HD_GLYPHS)
+			visible[cells[i]] = true;
+	}
+
+	slot = -1;
+	for (i = 0; i < HD_GLYPHS; i++) {
+		g = &state->hd_glyphs[i];
+		if (!g->g_loaded) {
+			slot = i;
+			break;
+		}
+		if (visible[i])
+			continue;
+		if (slot == -1 || g->g_used < state->hd_glyphs[slot].g_used)
+			slot = i;
+	}
+	if (slot == -1) {
+		for (i = 0; i < HD_GLYPHS; i++) {
+			g = &state->hd_glyphs[i];
+			if (slot == -1 || g->g_used < state->hd_glyphs[slot].g_used)
+				slot = i;
+		}
+		debug(1, "replacing visible glyph %d", slot);
+	}
+
+	g = &state->hd_glyphs[slot];
+	debug(3, "loading glyph into slot %d", slot);
+	hd44780_output(state, HD_COMMAND, HD_CMD_SET_CGADDR |
+	    (slot * HD_GLYPH_ROWS));
+	hd44780_wait(state, state->hd_timing->t_exec);
+	for (i = 0; i < HD_GLYPH_ROWS; i++) {
+		hd44780_output(state, HD_DATA, bitmap[i]);
+		hd44780_wait(state, state->hd_timing->t_exec);
+	}
+	memcpy(g->g_bitmap, bitmap, sizeof(g->g_bitmap));
+	g->g_loaded = true;
+	g->g_used = state->hd_glyph_clock;
+	state->hd_stats.st_glyph_loads++;
+	return (slot);
+}
+
+/*
+ * Changed cells separated by at most this many unchanged cells are written
+ * as a single run, because rewriting a cell costs about as much as an
+ * address change.
+ */
+#define	HD_FLUSH_MAX_GAP	1
+
+/*
+ * Bring the display in sync with the frame buffer.  Each run of changed
+ * cells costs one address change plus the data writes.
+ */
+static void
+hd44780_flush(struct hd44780_state *state)
+{
+	uint8_t *frame, *shadow;
+	uint64_t t;
+	int row, col, start, end;
+	bool changed;
+
+	if (!state->hd_frame_mode)
+		return;
+
+	t = clock_nsec();
+	changed = false;
+	for (row = 0; row < state->hd_lines; row++) {
+		frame = &state->hd_frame[row * state->hd_width];
+		shadow = &state->hd_shadow[row * state->hd_width];
+		col = 0;
+		while (col < state->hd_width) {
+			if (frame[col] == shadow[col]) {
+				col++;
+				continue;
+			}
+			start = col;
+			end = col + 1;
+			for (col = end; col < state->hd_width; col++) {
+				if (frame[col] != shadow[col])
+					end = col + 1;
+				else if (col - end + 1 > HD_FLUSH_MAX_GAP)
+					break;
+			}
+
+			debug(3, "flush row %d cols %d-%d", row, start, end - 1);
+			changed = true;
+			hd44780_set_addr(state,
+			    hd44780_cell_addr(state, row, start));
+			for (col = start; col < end; col++) {
+				hd44780_output(state, HD_DATA, frame[col]);
+				hd44780_wait(state, state->hd_timing->t_exec);
+				shadow[col] = frame[col];
+			}
+		}
+	}
+
+	/* Put a visible cursor where the next character would go. */
+	if (state->hd_cursor || state->hd_blink)
+		hd44780_set_addr(state, hd44780_calc_addr(state));
+	if (changed)
+		hist_record(&state->hd_stats.st_frame, clock_nsec() - t);
+}
+
+/*
+ * Scroll the ticker by one position.  The display shift moves all lines
+ * at once and wraps around at the end of the DDRAM line, so this takes a
+ * single instruction however long the text is.
+ */
+static void
+hd44780_scroll(struct hd44780_state *state)
+{
+
+	hd44780_output(state, HD_COMMAND, HD_CMD_MOVE | HD_MOVE_DISP |
+	    HD_MOVE_LEFT);
+	hd44780_wait(state, state->hd_timing->t_exec);
+}
+
+/*
+ * In the frame mode the commands that move the cursor or erase characters
+ * only update the frame buffer and the logical cursor position.  Returns
+ * true if the command has been handled, otherwise it is executed on the
+ * display directly.
+ */
+static bool
+hd44780_frame_command(struct hd44780_state *state, enum command cmd)
+{
+
+	switch (cmd) {
+	case CMD_CLR:
+		/*
+		 * Show the previous frame before starting a new one, unless
+		 * the refresh rate decides what is shown.
+		 */
+		if (state->hd_refresh == 0)
+			hd44780_flush(state);
+		memset(state->hd_frame, ' ', sizeof(state->hd_frame));
+		state->hd_col = 0;
+		state->hd_row = 0;
+		return (true);
+
+	case CMD_HOME:
+		state->hd_col = 0;
+		state->hd_row = 0;
+		return (true);
+
+	case CMD_NL:
+		while (state->hd_col < state->hd_width)	/* NB: putc increments hd_col */
+			hd44780_putc(state, ' ');
+		if (state->hd_row < state->hd_lines - 1) {
+			state->hd_row++;
+			state->hd_col = 0;
+		}
+		return (true);
+
+	case CMD_CR:
+		state->hd_col = 0;
+		return (true);
+
+	case CMD_FLASH:
+		hd44780_flush(state);
+		return (false);
+
+	default:
+		/*
+		 * CMD_BKSP, CMD_TAB and CMD_EOL write the frame with putc,
+		 * CMD_RESET clears the frame.
+		 */
+		return (false);
+	}
+}
+
+static void
+hd44780_command(struct hd44780_state *state, enum command cmd)
+{
+
+	hd44780_command_n(state, cmd, 1);
+}
+
+/* Execute a command n times, BKSP and TAB do that in one go. */
+static void
+hd44780_command_n(struct hd44780_state *state, enum command cmd, int n)
+{
+	uint64_t start;
+	int i;
+
+	start = clock_nsec();
+	if (cmd == CMD_BKSP || cmd == CMD_TAB) {
+		hd44780_do_command(state, cmd, n);
+	} else {
+		for (i = 0; i < n; i++)
+			hd44780_do_command(state, cmd, 1);
+	}
+	state->hd_stats.st_cmds[cmd]++;
+	state->hd_stats.st_cmd_ns[cmd] += clock_nsec() - start;
+}
+
+/* Turn the display on, with the cursor if enabled, or off. */
+static void
+hd44780_display_ctrl(struct hd44780_state *state, bool on)
+{
+	uint8_t val;
+
+	val = HD_CMD_DISPCTRL;
+	if (on) {
+		val |= HD_DISP_ON;
+		if (state->hd_cursor)
+			val |= HD_CURSOR_ON;
+		if (state->hd_blink)
+			val |= HD_BLINK_ON;
+	}
+	hd44780_output(state, HD_COMMAND, val);
+	hd44780_wait(state, state->hd_timing->t_cmd);
+}
+
+/*
+ * A flash turns the display off and on twice, for this long each time.
+ * The last phase keeps the display on, so that the next flash is seen as
+ * a separate one.
+ */
+#define	HD_FLASH_PHASES		4
+#define	HD_FLASH_PHASE		USEC(200000)
+
+static void
+hd44780_flash_step(struct hd44780_state *state)
+{
+
+	state->hd_flash--;
+	if (state->hd_flash > 0)
+		hd44780_display_ctrl(state, state->hd_flash % 2 == 1);
+	state->hd_next_flash += HD_FLASH_PHASE;
+}
+
+/* Finish a flash in progress, waiting for its steps. */
+static void
+hd44780_flash_end(struct hd44780_state *state)
+{
+	uint64_t now;
+
+	while (state->hd_flash > 0) {
+		now = clock_nsec();
+		if (now < state->hd_next_flash)
+			hd44780_delay(state, state->hd_next_flash - now);
+		hd44780_flash_step(state);
+	}
+}
+
+/*
+ * Bring the controller from any state to the function set in val, by
+ * instruction as per datasheet.
+ */
+static void
+hd44780_reset_if(struct hd44780_state *state, uint8_t val)
+{
+	uint8_t val8;
+
+	/*
+	 * This needs to be repeated three times to guarantee a state
+	 * where the desired mode can be configured.
+	 */
+	val8 = HD_CMD_SETMODE;
+	val8 |= HD_MODE_8BIT_IF;
+	hd44780_output4(state, HD_COMMAND, val8);
+	hd44780_delay(state, state->hd_timing->t_init);
+	hd44780_output4(state, HD_COMMAND, val8);
+	hd44780_delay(state, state->hd_timing->t_init_next);
+	hd44780_output4(state, HD_COMMAND, val8);
+	hd44780_delay(state, state->hd_timing->t_init_next);
+
+	/*
+	 * At this point the display is in 8-bit mode, so execute
+	 * a command to enter the 4-bit mode if needed.
+	 */
+	if (state->hd_ifwidth == 4) {
+		hd44780_output4(state, HD_COMMAND, val);
+		hd44780_delay(state, state->hd_timing->t_init_next);
+	}
+
+	hd44780_output(state, HD_COMMAND, val);
+
+	/* The busy flag can be checked from here on. */
+	hd44780_wait(state, state->hd_timing->t_init);
+}
+
+static void
+hd44780_do_command(struct hd44780_state *state, enum command cmd, int n)
+{
+	int i;
+	uint8_t	val;
+
+	if (state->hd_frame_mode && hd44780_frame_command(state, cmd))
+		return;
+
+	switch (cmd) {
+	case CMD_RESET:	/* full manual reset and reconfigure as per datasheet */
+		debug(1, "hd44780: reset to %d-bit interface, %d lines, "
+		    "%s font,%s%s cursor",
+		    state->hd_ifwidth, state->hd_lines,
+		    state->hd_font ? "5x10" : "5x8",
+		    state->hd_cursor ? "" : " no",
+		    state->hd_blink ? " blinking" : "");
+
+		val = HD_CMD_SETMODE;
+		if (state->hd_ifwidth == 8)
+			val |= HD_MODE_8BIT_IF;
+		if (state->hd_lines != 1)
+			val |= HD_MODE_2LINES;
+		if (state->hd_font)
+			val |= HD_MODE_LARGE_FONT;
+
+		if (state->hd_if_ready) {
+			/* Found set up at start, only the font may differ. */
+			debug(2, "interface is set up, skipping the reset");
+			state->hd_if_ready = false;
+			hd44780_output(state, HD_COMMAND, val);
+			hd44780_wait(state, state->hd_timing->t_cmd);
+		} else {
+			hd44780_reset_if(state, val);
+		}
+
+		hd44780_display_ctrl(state, false);
+		hd44780_display_ctrl(state, true);
+		state->hd_flash = 0;
+
+		val = HD_CMD_ENTRYMODE;
+		val |= HD_ENTRY_INCR;
+		hd44780_output(state, HD_COMMAND, val);
+		hd44780_wait(state, state->hd_timing->t_cmd);
+		/* FALLTHROUGH */
+
+	case CMD_CLR:
+		hd44780_output(state, HD_COMMAND, HD_CMD_CLEAR);
+		hd44780_wait(state, state->hd_timing->t_clear);
+		memset(state->hd_shadow, ' ', sizeof(state->hd_shadow));
+		memset(state->hd_frame, ' ', sizeof(state->hd_frame));
+		state->hd_col = 0;
+		state->hd_row = 0;
+		break;
+
+	case CMD_BKSP:
+		/* Erase back to the start of the line, and flash beyond it. */
+		i = MIN(n, state->hd_col);
+		state->hd_col -= i;
+		hd44780_blank(state, state->hd_col, state->hd_col + i);
+		if (i < n) {
+			/* XXX */
+			hd44780_command(state, CMD_FLASH);
+		}
+		break;
+
+	case CMD_NL:
+		/*
+		 * Fill the remainder of the current line with spaces.  If there
+		 * is no space for another line, then the cursor is held at the
+		 * end position.  This way no characters will be output until
+		 * the screen is cleared or the cursor is moved otherwise.
+		 * Cells that are already blank are skipped.
+		 */
+		for (; state->hd_col < state->hd_width; state->hd_col++) {
+			i = state->hd_row * state->hd_width + state->hd_col;
+			if (state->hd_shadow[i] == ' ')
+				continue;
+			hd44780_putc(state, ' ');
+			state->hd_col--;	/* NB: putc increments hd_col */
+		}
+		if (state->hd_row < state->hd_lines - 1) {
+			state->hd_row++;
+			state->hd_col = 0;
+			hd44780_set_addr(state, hd44780_calc_addr(state));
+		}
+		break;
+
+	case CMD_CR:
+		state->hd_col = 0;
+		hd44780_set_addr(state, hd44780_calc_addr(state));
+		break;
+
+	case CMD_HOME:
+		/* just move to address 0, also resets display shift */
+		hd44780_output(state, HD_COMMAND, HD_CMD_HOME);
+		hd44780_wait(state, state->hd_timing->t_clear);
+		state->hd_col = 0;
+		state->hd_row = 0;
+		break;
+
+	case CMD_TAB:
+		i = state->hd_col;
+		state->hd_col += 8 * n - state->hd_col % 8;
+		if (state->hd_col > state->hd_width)
+			state->hd_col = state->hd_width;
+		hd44780_blank(state, i, state->hd_col);
+		break;
+
+	case CMD_EOL:
+		hd44780_blank(state, state->hd_col, state->hd_width);
+		break;
+
+	case CMD_FLASH:
+		/* Overlapping flashes are merged into one. */
+		if (state->hd_flash == 0) {
+			hd44780_display_ctrl(state, false);
+			state->hd_flash = HD_FLASH_PHASES;
+			state->hd_next_flash = clock_nsec() + HD_FLASH_PHASE;
+		}
+		/* Without an output thread to time the rest, wait for it. */
+		if (state->hd_queue == NULL)
+			hd44780_flash_end(state);
+		break;
+
+	default:
+		if (isprint(cmd)) {
+			warnx("unknown command %c", cmd);
+		} else {
+			warnx("unknown command 0x%x", cmd);
+		}
+	}
+}
+
+static void
+hd44780_putc(struct hd44780_state *state, int c)
+{
+	/*
+	 * Won't print beyond the screen even if there is off-screen DDRAM
+	 * available, except in the ticker mode where the display shift
+	 * brings the rest of the line into view.
+	 */
+	if (state->hd_col == state->hd_width)
+		return;
+	if (state->hd_frame_mode) {
+		state->hd_frame[state->hd_row * state->hd_width +
+		    state->hd_col] = c;
+		state->hd_col++;
+		return;
+	}
+	hd44780_set_addr(state, hd44780_calc_addr(state));
+	hd44780_output(state, HD_DATA, c);
+	hd44780_wait(state, state->hd_timing->t_exec);
+	state->hd_shadow[state->hd_row * state->hd_width + state->hd_col] = c;
+	state->hd_col++;
+}
+
+/*
+ * Write blanks over the cells of the current line from start to end,
+ * leaving out those that are blank already.  The cursor position is
+ * not changed, and the address is only set again when needed.
+ */
+static void
+hd44780_blank(struct hd44780_state *state, int start, int end)
+{
+	uint8_t *cells;
+	int col, save;
+
+	cells = state->hd_frame_mode ? state->hd_frame : state->hd_shadow;
+	cells += state->hd_row * state->hd_width;
+	save = state->hd_col;
+	for (col = start; col < end; col++) {
+		if (cells[col] == ' ')
+			continue;
+		state->hd_col = col;
+		hd44780_putc(state, ' ');
+	}
+	state->hd_col = save;
+
+	/* Put a visible cursor where the next character would go. */
+	if (!state->hd_frame_mode && (state->hd_cursor || state->hd_blink))
+		hd44780_set_addr(state, hd44780_calc_addr(state));
+}
+
+/*
+ * Write a run of printable characters.  Like hd44780_putc() stops at the
+ * end of the line.
+ */
+static void
+hd44780_puts(struct hd44780_state *state, const char *s, size_t len)
+{
+	uint8_t *cells;
+	size_t i;
+
+	if (len > (size_t)(state->hd_width - state->hd_col))
+		len = state->hd_width - state->hd_col;
+	if (len == 0)
+		return;
+
+	if (state->hd_frame_mode) {
+		cells = &state->hd_frame[state->hd_row * state->hd_width +
+		    state->hd_col];
+	} else {
+		cells = &state->hd_shadow[state->hd_row * state->hd_width +
+		    state->hd_col];
+		hd44780_set_addr(state, hd44780_calc_addr(state));
+		for (i = 0; i < len; i++) {
+			hd44780_output(state, HD_DATA, s[i]);
+			hd44780_wait(state, state->hd_timing->t_exec);
+		}
+	}
+	memcpy(cells, s, len);
+	state->hd_col += len;
+}
+
+/*
+ * Write a user defined glyph at the cursor position.  Its character code
+ * is the CGRAM slot it is loaded in.
+ */
+static void
+hd44780_put_glyph(struct hd44780_state *state, const uint8_t *bitmap)
+{
+
+	if (state->hd_col == state->hd_width)
+		return;
+	hd44780_putc(state, hd44780_glyph_slot(state, bitmap));
+}
+
+/*
+ * Move the cursor to a cell, or to the end of the line if the column is
+ * beyond it.  The address is set by the next write, or right away if the
+ * cursor is visible.
+ */
+static void
+hd44780_move(struct hd44780_state *state, int row, int col)
+{
+
+	state->hd_row = MIN(row, state->hd_lines - 1);
+	state->hd_col = MIN(col, state->hd_width);
+	if (!state->hd_frame_mode && (state->hd_cursor || state->hd_blink))
+		hd44780_set_addr(state, hd44780_calc_addr(state));
+}
+
+static void
+hd44780_backlight(struct hd44780_state *state, bool on)
+{
+
+	if (state->pins[HD_PIN_BL] == -1) {
+		debug(1, "no backlight pin");
+		return;
+	}
+	hd44780_bus_lock(state);
+	hd44780_set_pin(state, HD_PIN_BL, on);
+	hd44780_bus_unlock(state);
+}
+
+/******************************************************************************
+ * GPIO backends.
+ */
+
+static int
+gpioc_open(struct hd44780_state *state, const char *devname)
+{
+
+	state->hd_fd = open(devname, O_RDWR, 0);
+	return (state->hd_fd == -1 ? -1 : 0);
+}
+
+static void
+gpioc_close(struct hd44780_state *state)
+{
+
+	close(state->hd_fd);
+}
+
+static int
+gpioc_ioctl(struct hd44780_state *state, unsigned long cmd, void *arg)
+{
+
+	return (ioctl(state->hd_fd, cmd, arg));
+}
+
+static const struct hd44780_backend gpioc_backend = {
+	.name = "gpioc",
+	.bk_default_dev = DEFAULT_DEVICE,
+	.bk_open = gpioc_open,
+	.bk_close = gpioc_close,
+	.bk_ioctl = gpioc_ioctl,
+};
+
+/*
+ * The GPIO controller of the SoC driven directly through its registers,
+ * mapped from physical memory.  A pin changes with a store instead of an
+ * ioctl, in a few nanoseconds, so the bus timing is all up to the delays
+ * of the driver.  Nothing arbitrates with the kernel driver or with other
+ * programs, so the pins used must not be used by anything else.  Banks
+ * of 32 pins are the GPIOACCESS32 banks of the driver.
+ */
+struct mmio_soc {
+	int	ms_npins;
+	size_t	ms_size;	/* of the register window */
+	uint32_t (*ms_get_config)(volatile uint32_t *regs, int pin);
+	void	(*ms_set_config)(volatile uint32_t *regs, int pin,
+		    uint32_t flags);
+	uint32_t (*ms_read)(volatile uint32_t *regs, int bank);
+	void	(*ms_write)(volatile uint32_t *regs, int bank, uint32_t mask,
+		    uint32_t values);
+};
+
+struct mmio_gpio {
+	const struct mmio_soc *mm_soc;
+	volatile uint32_t *mm_regs;
+	void	*mm_map;
+	size_t	mm_maplen;
+};
+
+/*
+ * BCM2835 and its successors up to BCM2711: a function select register
+ * for each 10 pins and write-only set and clear registers next to the
+ * level registers, for each bank.
+ */
+#define	BCM_GPFSEL(pin)		((pin) / 10)
+#define	BCM_GPSET(bank)		(7 + (bank))
+#define	BCM_GPCLR(bank)		(10 + (bank))
+#define	BCM_GPLEV(bank)		(13 + (bank))
+#define	BCM_FSEL_SHIFT(pin)	(3 * ((pin) % 10))
+#define	BCM_FSEL_MASK		0x7
+#define		BCM_FSEL_INPUT		0
+#define		BCM_FSEL_OUTPUT		1
+
+static uint32_t
+bcm2835_get_config(volatile uint32_t *regs, int pin)
+{
+
+	switch ((regs[BCM_GPFSEL(pin)] >> BCM_FSEL_SHIFT(pin)) &
+	    BCM_FSEL_MASK) {
+	case BCM_FSEL_INPUT:
+		return (GPIO_PIN_INPUT);
+	case BCM_FSEL_OUTPUT:
+		return (GPIO_PIN_OUTPUT);
+	default:
+		return (0);
+	}
+}
+
+static void
+bcm2835_set_config(volatile uint32_t *regs, int pin, uint32_t flags)
+{
+	uint32_t val;
+
+	val = regs[BCM_GPFSEL(pin)];
+	val &= ~(BCM_FSEL_MASK << BCM_FSEL_SHIFT(pin));
+	if ((flags & GPIO_PIN_OUTPUT) != 0)
+		val |= BCM_FSEL_OUTPUT << BCM_FSEL_SHIFT(pin);
+	regs[BCM_GPFSEL(pin)] = val;
+}
+
+static uint32_t
+bcm2835_read(volatile uint32_t *regs, int bank)
+{
+
+	return (regs[BCM_GPLEV(bank)]);
+}
+
+static void
+bcm2835_write(volatile uint32_t *regs, int bank, uint32_t mask,
+    uint32_t values)
+{
+
+	if ((mask & ~values) != 0)
+		regs[BCM_GPCLR(bank)] = mask & ~values;
+	if ((mask & values) != 0)
+		regs[BCM_GPSET(bank)] = mask & values;
+}
+
+static const struct mmio_soc bcm2835_soc = {
+	.ms_npins = 54,
+	.ms_size = 0xb4,
+	.ms_get_config = bcm2835_get_config,
+	.ms_set_config = bcm2835_set_config,
+	.ms_read = bcm2835_read,
+	.ms_write = bcm2835_write,
+};
+
+/*
+ * Allwinner A10 and later: a block of registers for each port of 32 pins,
+ * with a configuration register for each 8 pins and a data register.
+ * Changing some of the pins of a port takes a read-modify-write.
+ */
+#define	SUNXI_PORT(bank)	((bank) * 9)
+#define	SUNXI_CFG(pin)		(SUNXI_PORT((pin) / 32) + (pin) % 32 / 8)
+#define	SUNXI_DAT(bank)		(SUNXI_PORT(bank) + 4)
+#define	SUNXI_CFG_SHIFT(pin)	(4 * ((pin) % 8))
+#define	SUNXI_CFG_MASK		0x7
+#define		SUNXI_CFG_INPUT		0
+#define		SUNXI_CFG_OUTPUT	1
+#define	SUNXI_PORTS		9
+
+static uint32_t
+sunxi_get_config(volatile uint32_t *regs, int pin)
+{
+
+	switch ((regs[SUNXI_CFG(pin)] >> SUNXI_CFG_SHIFT(pin)) &
+	    SUNXI_CFG_MASK) {
+	case SUNXI_CFG_INPUT:
+		return (GPIO_PIN_INPUT);
+	case SUNXI_CFG_OUTPUT:
+		return (GPIO_PIN_OUTPUT);
+	default:
+		return (0);
+	}
+}
+
+static void
+sunxi_set_config(volatile uint32_t *regs, int pin, uint32_t flags)
+{
+	uint32_t val;
+
+	val = regs[SUNXI_CFG(pin)];
+	val &= ~(SUNXI_CFG_MASK << SUNXI_CFG_SHIFT(pin));
+	if ((flags & GPIO_PIN_OUTPUT) != 0)
+		val |= SUNXI_CFG_OUTPUT << SUNXI_CFG_SHIFT(pin);
+	regs[SUNXI_CFG(pin)] = val;
+}
+
+static uint32_t
+sunxi_read(volatile uint32_t *regs, int bank)
+{
+
+	return (regs[SUNXI_DAT(bank)]);
+}
+
+static void
+sunxi_write(volatile uint32_t *regs, int bank, uint32_t mask,
+    uint32_t values)
+{
+
+	regs[SUNXI_DAT(bank)] = (regs[SUNXI_DAT(bank)] & ~mask) |
+	    (values & mask);
+}
+
+static const struct mmio_soc sunxi_soc = {
+	.ms_npins = SUNXI_PORTS * HD_BANK_SIZE,
+	.ms_size = SUNXI_PORTS * 0x24,
+	.ms_get_config = sunxi_get_config,
+	.ms_set_config = sunxi_set_config,
+	.ms_read = sunxi_read,
+	.ms_write = sunxi_write,
+};
+
+/* Map the registers at the physical address given as the device. */
+static int
+mmio_open(struct hd44780_state *state, const char *devname,
+    const struct mmio_soc *soc)
+{
+	struct mmio_gpio *mm;
+	unsigned long long addr;
+	size_t maplen, off, pagesize;
+	char *endp;
+	void *map;
+	int fd;
+
+	errno = 0;
+	addr = strtoull(devname, &endp, 0);
+	if (*endp != '\0' || errno != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((fd = open(MMIO_DEVICE, O_RDWR, 0)) == -1)
+		return (-1);
+	pagesize = getpagesize();
+	off = addr % pagesize;
+	maplen = roundup(off + soc->ms_size, pagesize);
+	map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    addr - off);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+	if ((mm = calloc(1, sizeof(*mm))) == NULL) {
+		munmap(map, maplen);
+		return (-1);
+	}
+	mm->mm_soc = soc;
+	mm->mm_map = map;
+	mm->mm_maplen = maplen;
+	mm->mm_regs = (volatile uint32_t *)((char *)map + off);
+	debug(2, "GPIO registers at 0x%llx mapped", addr);
+	state->hd_backend_priv = mm;
+	state->hd_fd = -1;
+	return (0);
+}
+
+static void
+mmio_close(struct hd44780_state *state)
+{
+	struct mmio_gpio *mm = state->hd_backend_priv;
+
+	munmap(mm->mm_map, mm->mm_maplen);
+	free(mm);
+	state->hd_backend_priv = NULL;
+}
+
+static int
+mmio_ioctl(struct hd44780_state *state, unsigned long cmd, void *arg)
+{
+	struct mmio_gpio *mm = state->hd_backend_priv;
+	const struct mmio_soc *soc = mm->mm_soc;
+	struct gpio_access_32 *acc;
+	struct gpio_pin *cfg;
+	struct gpio_req *req;
+	uint32_t ebit, mask, values;
+	int bank, e;
+
+	switch (cmd) {
+	case GPIOGETCONFIG:
+	case GPIOSETCONFIG:
+		cfg = arg;
+		if (cfg->gp_pin >= (uint32_t)soc->ms_npins)
+			break;
+		if (cmd == GPIOSETCONFIG)
+			soc->ms_set_config(mm->mm_regs, cfg->gp_pin,
+			    cfg->gp_flags);
+		else
+			cfg->gp_flags = soc->ms_get_config(mm->mm_regs,
+			    cfg->gp_pin);
+		return (0);
+	case GPIOGET:
+		req = arg;
+		if (req->gp_pin >= (uint32_t)soc->ms_npins)
+			break;
+		req->gp_value = (soc->ms_read(mm->mm_regs,
+		    req->gp_pin / HD_BANK_SIZE) >>
+		    (req->gp_pin % HD_BANK_SIZE)) & 1;
+		return (0);
+	case GPIOSET:
+		req = arg;
+		if (req->gp_pin >= (uint32_t)soc->ms_npins)
+			break;
+		mask = 1u << (req->gp_pin % HD_BANK_SIZE);
+		soc->ms_write(mm->mm_regs, req->gp_pin / HD_BANK_SIZE, mask,
+		    req->gp_value ? mask : 0);
+		return (0);
+	case GPIOACCESS32:
+		acc = arg;
+		if (acc->first_pin % HD_BANK_SIZE != 0 ||
+		    acc->first_pin >= (uint32_t)soc->ms_npins)
+			break;
+		bank = acc->first_pin / HD_BANK_SIZE;
+		acc->orig_pins = soc->ms_read(mm->mm_regs, bank);
+		mask = acc->clear_pins | acc->change_pins;
+		values = (acc->orig_pins & ~acc->clear_pins) ^ acc->change_pins;
+		/* Change E last, after the other lines have settled. */
+		e = state->pins[HD_PIN_E] - acc->first_pin;
+		ebit = (e >= 0 && e < HD_BANK_SIZE) ? 1u << e : 0;
+		soc->ms_write(mm->mm_regs, bank, mask & ~ebit, values);
+		if ((mask & ebit) != 0)
+			soc->ms_write(mm->mm_regs, bank, ebit, values);
+		return (0);
+	}
+	errno = EINVAL;
+	return (-1);
+}
+
+static int
+bcm2835_open(struct hd44780_state *state, const char *devname)
+{
+
+	return (mmio_open(state, devname, &bcm2835_soc));
+}
+
+static int
+sunxi_open(struct hd44780_state *state, const char *devname)
+{
+
+	return (mmio_open(state, devname, &sunxi_soc));
+}
+
+/* The default addresses are those of BCM2836/BCM2837 and of A10 to H3. */
+static const struct hd44780_backend bcm2835_backend = {
+	.name = "bcm2835",
+	.bk_default_dev = "0x3f200000",
+	.bk_open = bcm2835_open,
+	.bk_close = mmio_close,
+	.bk_ioctl = mmio_ioctl,
+};
+
+static const struct hd44780_backend sunxi_backend = {
+	.name = "sunxi",
+	.bk_default_dev = "0x01c20800",
+	.bk_open = sunxi_open,
+	.bk_close = mmio_close,
+	.bk_ioctl = mmio_ioctl,
+};
+
+/*
+ * Simulated HD44780 controller.  It watches the pins the way the real
+ * controller does: an instruction or data is latched when E falls with
+ * R/W low, the data lines are driven while E is high with R/W high.
+ * Instructions take the datasheet time to execute, and anything written
+ * while the controller is still busy is lost and counted as a timing
+ * violation.
+ */
+#define	SIM_MAXPIN		64
+#define	SIM_T_EXEC		USEC(37)
+#define	SIM_T_CLEAR		USEC(1520)
+
+struct sim_hd44780 {
+	bool		sim_value[SIM_MAXPIN];
+	uint32_t	sim_flags[SIM_MAXPIN];
+	bool		sim_if8;	/* 8-bit interface mode */
+	bool		sim_2lines;
+	bool		sim_incr;	/* entry mode: increment address */
+	bool		sim_autoshift;	/* entry mode: shift display */
+	bool		sim_nibble;	/* waiting for the second nibble */
+	uint8_t		sim_latch;	/* first nibble */
+	uint8_t		sim_rdata;	/* byte being read */
+	uint8_t		sim_dispctrl;
+	uint8_t		sim_ac;
+	bool		sim_cgaddr;	/* address counter points to CGRAM */
+	int		sim_shift;	/* display shift */
+	uint8_t		sim_ddram[128];
+	uint8_t		sim_cgram[64];
+	uint64_t	sim_busy_until;
+	uint64_t	sim_violations;
+};
+
+static bool
+sim_pin(struct hd44780_state *state, struct sim_hd44780 *sim,
+    enum hd_pin_id id)
+{
+
+	if (state->pins[id] < 0 || state->pins[id] >= SIM_MAXPIN)
+		return (false);
+	return (sim->sim_value[state->pins[id]]);
+}
+
+/* Value on DB0-DB7 as seen by the controller. */
+static uint8_t
+sim_bus(struct hd44780_state *state, struct sim_hd44780 *sim)
+{
+	uint8_t bus;
+	int i;
+
+	bus = 0;
+	for (i = 0; i < state->hd_ifwidth; i++) {
+		if (sim_pin(state, sim, HD_PIN_DAT0 + i))
+			bus |= 1 << i;
+	}
+	return (state->hd_ifwidth == 8 ? bus : bus << 4);
+}
+
+static void
+sim_step_addr(struct sim_hd44780 *sim, bool incr)
+{
+
+	if (sim->sim_cgaddr) {
+		sim->sim_ac = (sim->sim_ac + (incr ? 1 : -1)) & 0x3f;
+		return;
+	}
+	sim->sim_ac = hd44780_step_addr(sim->sim_ac, sim->sim_2lines, incr);
+}
+
+static void
+sim_execute(struct sim_hd44780 *sim, bool rs, uint8_t val)
+{
+	uint64_t now;
+
+	now = clock_nsec();
+	if (now < sim->sim_busy_until) {
+		debug(2, "sim: %s 0x%02x while busy", rs ? "data" : "cmd ", val);
+		sim->sim_violations++;
+		return;
+	}
+	sim->sim_busy_until = now + SIM_T_EXEC;
+
+	if (rs) {
+		if (sim->sim_cgaddr)
+			sim->sim_cgram[sim->sim_ac] = val;
+		else
+			sim->sim_ddram[sim->sim_ac] = val;
+		sim_step_addr(sim, sim->sim_incr);
+		if (sim->sim_autoshift)
+			sim->sim_shift += sim->sim_incr ? 1 : -1;
+		return;
+	}
+
+	if ((val & HD_CMD_SET_ADDR) != 0) {
+		sim->sim_ac = val & ~HD_CMD_SET_ADDR;
+		sim->sim_cgaddr = false;
+	} else if ((val & HD_CMD_SET_CGADDR) != 0) {
+		sim->sim_ac = val & ~HD_CMD_SET_CGADDR;
+		sim->sim_cgaddr = true;
+	} else if ((val & HD_CMD_SETMODE) != 0) {
+		sim->sim_if8 = (val & HD_MODE_8BIT_IF) != 0;
+		sim->sim_2lines = (val & HD_MODE_2LINES) != 0;
+	} else if ((val & HD_CMD_MOVE) != 0) {
+		if ((val & HD_MOVE_DISP) != 0)
+			sim->sim_shift += (val & HD_MOVE_RIGHT) ? -1 : 1;
+		else
+			sim_step_addr(sim, (val & HD_MOVE_RIGHT) != 0);
+	} else if ((val & HD_CMD_DISPCTRL) != 0) {
+		sim->sim_dispctrl = val;
+	} else if ((val & HD_CMD_ENTRYMODE) != 0) {
+		sim->sim_incr = (val & HD_ENTRY_INCR) != 0;
+		sim->sim_autoshift = (val & HD_DISP_SHIFT) != 0;
+	} else if ((val & HD_CMD_HOME) != 0) {
+		sim->sim_ac = 0;
+		sim->sim_cgaddr = false;
+		sim->sim_shift = 0;
+		sim->sim_busy_until = now + SIM_T_CLEAR;
+	} else if ((val & HD_CMD_CLEAR) != 0) {
+		memset(sim->sim_ddram, ' ', sizeof(sim->sim_ddram));
+		sim->sim_ac = 0;
+		sim->sim_cgaddr = false;
+		sim->sim_shift = 0;
+		sim->sim_incr = true;
+		sim->sim_busy_until = now + SIM_T_CLEAR;
+	}
+}
+
+/* React to a change of E. */
+static void
+sim_strobe(struct hd44780_state *state, struct sim_hd44780 *sim, bool e)
+{
+	bool rs, rw;
+
+	rs = sim_pin(state, sim, HD_PIN_RS);
+	rw = sim_pin(state, sim, HD_PIN_RW);
+
+	if (rw) {
+		/* Prepare the output on the rising edge of E. */
+		if (e && !sim->sim_nibble) {
+			if (rs) {
+				sim->sim_rdata = sim->sim_cgaddr ?
+				    sim->sim_cgram[sim->sim_ac] :
+				    sim->sim_ddram[sim->sim_ac];
+				sim_step_addr(sim, sim->sim_incr);
+			} else {
+				sim->sim_rdata = sim->sim_ac;
+				if (clock_nsec() < sim->sim_busy_until)
+					sim->sim_rdata |= HD_STATUS_BUSY;
+			}
+		}
+		if (!e && !sim->sim_if8)
+			sim->sim_nibble = !sim->sim_nibble;
+		return;
+	}
+
+	/* Latch the input on the falling edge of E. */
+	if (e)
+		return;
+	if (sim->sim_if8) {
+		sim_execute(sim, rs, sim_bus(state, sim));
+	} else if (!sim->sim_nibble) {
+		sim->sim_latch = sim_bus(state, sim) & 0xf0;
+		sim->sim_nibble = true;
+	} else {
+		sim->sim_nibble = false;
+		sim_execute(sim, rs, sim->sim_latch | sim_bus(state, sim) >> 4);
+	}
+}
+
+/* Value of a pin as read by the driver. */
+static bool
+sim_read_pin(struct hd44780_state *state, struct sim_hd44780 *sim,
+    uint32_t pin)
+{
+	uint8_t bus;
+	int i;
+
+	if (sim_pin(state, sim, HD_PIN_RW) && sim_pin(state, sim, HD_PIN_E) &&
+	    (sim->sim_flags[pin] & GPIO_PIN_INPUT) != 0) {
+		bus = sim->sim_rdata;
+		if (!sim->sim_if8)
+			bus = sim->sim_nibble ? bus << 4 : bus & 0xf0;
+		if (state->hd_ifwidth == 4)
+			bus >>= 4;
+		for (i = 0; i < state->hd_ifwidth; i++) {
+			if ((uint32_t)state->pins[HD_PIN_DAT0 + i] == pin)
+				return ((bus & (1 << i)) != 0);
+		}
+	}
+	return (sim->sim_value[pin]);
+}
+
+static void
+sim_write_pin(struct hd44780_state *state, struct sim_hd44780 *sim,
+    uint32_t pin, bool value)
+{
+	bool old;
+
+	old = sim->sim_value[pin];
+	sim->sim_value[pin] = value;
+	if ((int)pin == state->pins[HD_PIN_E] && old != value)
+		sim_strobe(state, sim, value);
+}
+
+static int
+sim_open(struct hd44780_state *state, const char *devname __unused)
+{
+	struct sim_hd44780 *sim;
+
+	if ((sim = calloc(1, sizeof(*sim))) == NULL)
+		return (-1);
+	/* The power-on state. */
+	sim->sim_if8 = true;
+	sim->sim_incr = true;
+	memset(sim->sim_ddram, ' ', sizeof(sim->sim_ddram));
+	state->hd_backend_priv = sim;
+	state->hd_fd = -1;
+	return (0);
+}
+
+/* Dump what the simulated display shows. */
+static void
+sim_close(struct hd44780_state *state)
+{
+	struct sim_hd44780 *sim = state->hd_backend_priv;
+	int row, col, len, off;
+
+	if (debuglevel >= 1) {
+		len = sim->sim_2lines ? HD_LINE_DRAM_SIZE : 2 * HD_LINE_DRAM_SIZE;
+		for (row = 0; row < state->hd_lines; row++) {
+			fputc('|', stderr);
+			for (col = 0; col < state->hd_cols; col++) {
+				off = col + sim->sim_shift;
+				if (row >= 2)
+					off += state->hd_cols;
+				off = (off % len + len) % len;
+				if (row & 1)
+					off += HD_LINE1_DRAM_OFFSET;
+				fputc(isprint(sim->sim_ddram[off]) ?
+				    sim->sim_ddram[off] : '?', stderr);
+			}
+			fputs("|\n", stderr);
+		}
+		fprintf(stderr, "sim: %ju timing violations\n",
+		    (uintmax_t)sim->sim_violations);
+	}
+	free(sim);
+	state->hd_backend_priv = NULL;
+}
+
+static int
+sim_ioctl(struct hd44780_state *state, unsigned long cmd, void *arg)
+{
+	struct sim_hd44780 *sim = state->hd_backend_priv;
+	struct gpio_access_32 *acc;
+	struct gpio_pin *cfg;
+	struct gpio_req *req;
+	uint32_t bit;
+	int i;
+
+	switch (cmd) {
+	case GPIOGETCONFIG:
+	case GPIOSETCONFIG:
+		cfg = arg;
+		if (cfg->gp_pin >= SIM_MAXPIN)
+			break;
+		if (cmd == GPIOSETCONFIG)
+			sim->sim_flags[cfg->gp_pin] = cfg->gp_flags;
+		else
+			cfg->gp_flags = sim->sim_flags[cfg->gp_pin];
+		return (0);
+	case GPIOGET:
+		req = arg;
+		if (req->gp_pin >= SIM_MAXPIN)
+			break;
+		req->gp_value = sim_read_pin(state, sim, req->gp_pin);
+		return (0);
+	case GPIOSET:
+		req = arg;
+		if (req->gp_pin >= SIM_MAXPIN)
+			break;
+		sim_write_pin(state, sim, req->gp_pin, req->gp_value != 0);
+		return (0);
+	case GPIOACCESS32:
+		acc = arg;
+		if (acc->first_pin % HD_BANK_SIZE != 0 ||
+		    acc->first_pin >= SIM_MAXPIN)
+			break;
+		acc->orig_pins = 0;
+		for (i = 0; i < HD_BANK_SIZE; i++) {
+			if (sim_read_pin(state, sim, acc->first_pin + i))
+				acc->orig_pins |= 1u << i;
+		}
+		/* Change E last, as if the other lines settled before it. */
+		for (i = 0; i < HD_BANK_SIZE; i++) {
+			bit = 1u << i;
+			if ((int)acc->first_pin + i == state->pins[HD_PIN_E])
+				continue;
+			if (((acc->clear_pins | acc->change_pins) & bit) == 0)
+				continue;
+			sim_write_pin(state, sim, acc->first_pin + i,
+			    ((acc->orig_pins & ~acc->clear_pins) ^
+			    acc->change_pins) & bit);
+		}
+		i = state->pins[HD_PIN_E] - acc->first_pin;
+		if (i >= 0 && i < HD_BANK_SIZE &&
+		    ((acc->clear_pins | acc->change_pins) & (1u << i)) != 0)
+			sim_write_pin(state, sim, state->pins[HD_PIN_E],
+			    ((acc->orig_pins & ~acc->clear_pins) ^
+			    acc->change_pins) & (1u << i));
+		return (0);
+	}
+	errno = EINVAL;
+	return (-1);
+}
+
+static const struct hd44780_backend sim_backend = {
+	.name = "sim",
+	.bk_default_dev = "sim",
+	.bk_open = sim_open,
+	.bk_close = sim_close,
+	.bk_ioctl = sim_ioctl,
+};
+
+/******************************************************************************
+ * Benchmarks.
+ */
+
+enum bench_workload {
+	BENCH_REDRAW,	/* every cell changes in every frame */
+	BENCH_STREAM,	/* lines of text of varying length */
+	BENCH_CELL,	/* a single cell changes in every frame */
+	BENCH_COUNT,
+};
+
+static const char *const bench_names[BENCH_COUNT] = {
+	[BENCH_REDRAW] = "redraw",
+	[BENCH_STREAM] = "stream",
+	[BENCH_CELL] = "cell",
+};
+
+/* Build the input for one frame of a workload, returns its length. */
+static size_t
+bench_frame(struct hd44780_state *state, enum bench_workload w, int frame,
+    char *buf, size_t *nchars)
+{
+	size_t len;
+	int row, col, n;
+
+	len = 0;
+	*nchars = 0;
+	buf[len++] = '\f';
+	for (row = 0; row < state->hd_lines; row++) {
+		switch (w) {
+		case BENCH_REDRAW:
+			n = state->hd_cols;
+			for (col = 0; col < n; col++)
+				buf[len++] = 'A' + (frame + row + col) % 26;
+			break;
+		case BENCH_STREAM:
+			n = snprintf(buf + len, state->hd_cols + 1,
+			    "line %d%.*s", frame * state->hd_lines + row,
+			    (frame + row) % state->hd_cols, "........................................");
+			if (n > state->hd_cols)
+				n = state->hd_cols;
+			len += n;
+			break;
+		case BENCH_CELL:
+			n = state->hd_cols;
+			for (col = 0; col < n; col++) {
+				if (row * state->hd_cols + col ==
+				    frame % (state->hd_lines * state->hd_cols))
+					buf[len++] = '0' + frame % 10;
+				else
+					buf[len++] = '-';
+			}
+			break;
+		default:
+			abort();
+		}
+		*nchars += n;
+		if (row < state->hd_lines - 1)
+			buf[len++] = '\n';
+	}
+	return (len);
+}
+
+/*
+ * Run each workload for the given number of frames and report the
+ * throughput and the number of GPIO accesses per character.
+ */
+static void
+bench(struct hd44780_state *state, int frames)
+{
+	char buf[2 * HD_MAX_CELLS];
+	uint64_t start, elapsed, chars;
+	double sec;
+	size_t len, n;
+	int i, w;
+
+	printf("%-8s %8s %8s %10s %10s %12s\n", "workload", "frames",
+	    "chars", "chars/s", "frames/s", "ioctls/char");
+	for (w = 0; w < BENCH_COUNT; w++) {
+		hd44780_command(state, CMD_CLR);
+		hd44780_flush(state);
+		memset(&state->hd_stats, 0, sizeof(state->hd_stats));
+		chars = 0;
+		start = clock_nsec();
+		for (i = 0; i < frames; i++) {
+			len = bench_frame(state, w, i, buf, &n);
+			do_chars(state, buf, len);
+			hd44780_flush(state);
+			chars += n;
+		}
+		elapsed = clock_nsec() - start;
+		sec = elapsed / 1e9;
+		printf("%-8s %8d %8ju %10.1f %10.1f %12.2f\n", bench_names[w],
+		    frames, (uintmax_t)chars, chars / sec, frames / sec,
+		    chars > 0 ? (double)state->hd_stats.st_ioctls / chars : 0.0);
+	}
+}
+
+/******************************************************************************
+ * Calibration of the instruction timing.
+ */
+
+/*
+ * Samples taken of each instruction, and the share of the median time
+ * that is added to it in the profile.
+ */
+#define	CALIBRATE_RUNS		100
+#define	CALIBRATE_MARGIN	4	/* 1/4 */
+
+enum calibrate_instr {
+	CAL_CLEAR,
+	CAL_HOME,
+	CAL_ADDR,
+	CAL_DATA,
+	CAL_CMD,
+	CAL_COUNT,
+};
+
+static const char *const calibrate_names[CAL_COUNT] = {
+	[CAL_CLEAR] = "clear",
+	[CAL_HOME] = "home",
+	[CAL_ADDR] = "addr",
+	[CAL_DATA] = "data",
+	[CAL_CMD] = "cmd",
+};
+
+static const struct {
+	const char	*name;
+	size_t		offset;
+} timing_fields[] = {
+	{ "t_power", offsetof(struct hd44780_timing, t_power) },
+	{ "t_init", offsetof(struct hd44780_timing, t_init) },
+	{ "t_init_next", offsetof(struct hd44780_timing, t_init_next) },
+	{ "t_setup", offsetof(struct hd44780_timing, t_setup) },
+	{ "t_pulse", offsetof(struct hd44780_timing, t_pulse) },
+	{ "t_hold", offsetof(struct hd44780_timing, t_hold) },
+	{ "t_exec", offsetof(struct hd44780_timing, t_exec) },
+	{ "t_cmd", offsetof(struct hd44780_timing, t_cmd) },
+	{ "t_clear", offsetof(struct hd44780_timing, t_clear) },
+};
+
+#define	TIMING_FIELD(t, i)	\
+	((uint32_t *)((char *)(t) + timing_fields[i].offset))
+
+/*
+ * Write an instruction and return the time until the busy flag clears.
+ * The fixed delays start at the same point, after the transfer.
+ */
+static uint64_t
+calibrate_busy(struct hd44780_state *state, enum reg_type type, uint8_t val)
+{
+	uint64_t start;
+	int i;
+
+	hd44780_output(state, type, val);
+	start = clock_nsec();
+	for (i = 0; i < HD_BUSY_POLL_MAX; i++) {
+		if ((hd44780_read(state, HD_COMMAND, HD_STATUS_BUSY) &
+		    HD_STATUS_BUSY) == 0)
+			return (clock_nsec() - start);
+	}
+	errx(EX_IOERR, "busy flag does not clear");
+}
+
+static int
+calibrate_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Time each class of instructions on the display and write a profile
+ * with the median times plus a margin.  The busy flag is read back over
+ * the bus, so every sample is an upper bound of the time taken, and the
+ * longest ones are those where the poll was held up, not the controller.
+ * The bus timing and the reset delays cannot be seen on the busy flag,
+ * so they are those of the current profile.
+ */
+static void
+calibrate(struct hd44780_state *state, const char *path)
+{
+	struct hd44780_timing t;
+	uint64_t samples[CAL_COUNT][CALIBRATE_RUNS], med[CAL_COUNT], sum, ns;
+	FILE *fp;
+	uint8_t val;
+	int i, r;
+
+	for (r = 0; r < CALIBRATE_RUNS; r++) {
+		for (i = 0; i < CAL_COUNT; i++) {
+			switch (i) {
+			case CAL_CLEAR:
+				ns = calibrate_busy(state, HD_COMMAND,
+				    HD_CMD_CLEAR);
+				break;
+			case CAL_HOME:
+				ns = calibrate_busy(state, HD_COMMAND,
+				    HD_CMD_HOME);
+				break;
+			case CAL_ADDR:
+				val = HD_CMD_SET_ADDR | (r % HD_LINE_DRAM_SIZE);
+				ns = calibrate_busy(state, HD_COMMAND, val);
+				break;
+			case CAL_DATA:
+				ns = calibrate_busy(state, HD_DATA, ' ');
+				break;
+			default:
+				val = HD_CMD_ENTRYMODE | HD_ENTRY_INCR;
+				ns = calibrate_busy(state, HD_COMMAND, val);
+				break;
+			}
+			samples[i][r] = ns;
+		}
+	}
+	/* Leave the display blank as the shadow has it. */
+	hd44780_command(state, CMD_CLR);
+
+	printf("%-8s %8s %10s %10s %10s %10s\n", "instr", "samples",
+	    "min us", "median us", "mean us", "max us");
+	for (i = 0; i < CAL_COUNT; i++) {
+		qsort(samples[i], CALIBRATE_RUNS, sizeof(samples[i][0]),
+		    calibrate_cmp);
+		med[i] = samples[i][CALIBRATE_RUNS / 2];
+		sum = 0;
+		for (r = 0; r < CALIBRATE_RUNS; r++)
+			sum += samples[i][r];
+		printf("%-8s %8d %10.1f %10.1f %10.1f %10.1f\n",
+		    calibrate_names[i], CALIBRATE_RUNS, samples[i][0] / 1e3,
+		    med[i] / 1e3, sum / 1e3 / CALIBRATE_RUNS,
+		    samples[i][CALIBRATE_RUNS - 1] / 1e3);
+	}
+
+	t = *state->hd_timing;
+	ns = MAX(med[CAL_CLEAR], med[CAL_HOME]);
+	t.t_clear = ns + ns / CALIBRATE_MARGIN;
+	ns = MAX(med[CAL_ADDR], med[CAL_DATA]);
+	t.t_exec = ns + ns / CALIBRATE_MARGIN;
+	ns = med[CAL_CMD];
+	t.t_cmd = ns + ns / CALIBRATE_MARGIN;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(EX_CANTCREAT, "can't open '%s'", path);
+	fprintf(fp, "# %s timing of %s, based on %s\n", progname,
+	    state->hd_devname, state->hd_timing->name);
+	for (i = 0; i < (int)nitems(timing_fields); i++)
+		fprintf(fp, "%s %u\n", timing_fields[i].name,
+		    *TIMING_FIELD(&t, i));
+	if (fclose(fp) != 0)
+		err(EX_IOERR, "can't write '%s'", path);
+	printf("profile written to %s\n", path);
+}
+
+/*
+ * Read a profile written by calibrate(), lines of a field name and a
+ * time in nanoseconds.  Fields left out are those of the default profile.
+ * Returns NULL if there is no such file.
+ */
+static const struct hd44780_timing *
+timing_load(const char *path)
+{
+	struct hd44780_timing *t;
+	char line[128], name[32];
+	unsigned long val;
+	FILE *fp;
+	int i, lineno;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return (NULL);
+		err(EX_NOINPUT, "can't open '%s'", path);
+	}
+	if ((t = malloc(sizeof(*t))) == NULL)
+		err(EX_OSERR, "malloc");
+	*t = hd44780_timings[0];
+	t->name = path;
+	for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%31s %lu", name, &val) != 2 ||
+		    val > UINT32_MAX)
+			errx(EX_DATAERR, "%s:%d: invalid line", path, lineno);
+		for (i = 0; i < (int)nitems(timing_fields); i++) {
+			if (strcmp(name, timing_fields[i].name) == 0)
+				break;
+		}
+		if (i == (int)nitems(timing_fields))
+			errx(EX_DATAERR, "%s:%d: unknown field %s", path,
+			    lineno, name);
+		*TIMING_FIELD(t, i) = val;
+	}
+	fclose(fp);
+	return (t);
 }